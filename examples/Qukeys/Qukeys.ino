@@ -68,7 +68,7 @@ void setup() {
     kaleidoscope::Qukey(0, 2, 2, Key_LeftAlt),      // S/alt
     kaleidoscope::Qukey(0, 2, 3, Key_LeftControl),  // D/ctrl
     kaleidoscope::Qukey(0, 2, 4, Key_LeftShift),    // F/shift
-    kaleidoscope::Qukey(0, 3, 6, ShiftToLayer(1))   // Q/layer-shift (on `fn`)
+    kaleidoscope::Qukey(0, 3, 6, ShiftToLayer(1), 120) // Q/layer-shift (on `fn`), 120ms timeout
   )
   Qukeys.setTimeout(200);
   Qukeys.setReleaseDelay(20);
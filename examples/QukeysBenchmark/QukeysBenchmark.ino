@@ -0,0 +1,181 @@
+// -*- mode: c++ -*-
+
+// Measures the time Qukeys adds to each scan cycle, for a few typical
+// workloads and qukey table sizes. The results are printed to the
+// serial port as CSV, once, a few seconds after startup:
+//
+//   workload,qukeys,cycles,total_us,ns_per_cycle
+//
+// Built with QUKEYS_PROFILE set to 1, it also times the calls of
+// Qukeys' flushKey() and lookupQukey() on their own, with four more
+// columns: the number of calls of each, and the average time per call.
+//
+//   flush_key_calls,flush_key_ns,lookup_qukey_calls,lookup_qukey_ns
+//
+// Timing them slows down the scan cycles that call them, though, so
+// compare scan cycle times from builds without it.
+//
+// Every key in the keymap is blank, and the qukeys' alternate keycodes
+// are too, so nothing is sent to the host while the benchmark runs. On
+// an ATmega32U4 at 16MHz, one CPU cycle is 62.5ns; `micros()` has a
+// resolution of 4us, so each workload runs for many scan cycles. Any
+// keyboard with at least 32 keys will do.
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys.h>
+
+// One blank layer, whatever the keyboard's layout
+KEYMAPS(
+  [0] = {}
+)
+
+KALEIDOSCOPE_INIT_PLUGINS(Qukeys);
+
+namespace bench {
+
+// Number of scan cycles to run for each workload
+constexpr uint16_t CYCLES = 2000;
+// Qukeys are defined on the first `n` keys; "typing" uses the last ones.
+// The biggest table has 64 qukeys, or one on every key of a smaller
+// keyboard.
+static_assert(TOTAL_KEYS >= 32, "the benchmark needs at least 32 keys");
+constexpr uint8_t MAX_TABLE_SIZE = (TOTAL_KEYS < 64) ? TOTAL_KEYS : 64;
+constexpr uint8_t TABLE_SIZES[] = {0, 8, 32, MAX_TABLE_SIZE};
+
+kaleidoscope::Qukey qukey_table[MAX_TABLE_SIZE];
+
+bool key_down[TOTAL_KEYS];
+bool key_was_down[TOTAL_KEYS];
+
+// Run one scan cycle, the way the keyboard's matrix scan would
+uint32_t scanCycle() {
+  uint32_t start = micros();
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      kaleidoscope::addr::KeyAddr key_addr = kaleidoscope::addr::addr(row, col);
+      uint8_t key_state = ((key_down[key_addr] ? IS_PRESSED : 0) |
+                           (key_was_down[key_addr] ? WAS_PRESSED : 0));
+      key_was_down[key_addr] = key_down[key_addr];
+      if (KeyboardHardware.isKeyMasked(row, col)) {
+        if (!keyToggledOff(key_state))
+          continue;
+        KeyboardHardware.unMaskKey(row, col);
+      }
+      Key mapped_key = Key_NoKey;
+      Qukeys.onKeyswitchEvent(mapped_key, row, col, key_state);
+    }
+  }
+  Qukeys.beforeReportingState();
+  return micros() - start;
+}
+
+// Workloads; each one sets the keyswitch states for cycle `i`
+
+void idle(uint16_t) {}
+
+// One key at a time, never overlapping
+void typing(uint16_t i) {
+  kaleidoscope::addr::KeyAddr key_addr = TOTAL_KEYS - 1 - (i / 4) % 8;
+  key_down[key_addr] = (i % 4 < 2);
+}
+
+// A key on the first qukey, overlapping with the next two keys
+void rollover(uint16_t i) {
+  uint8_t step = i % 8;
+  key_down[0] = (step < 3);
+  key_down[TOTAL_KEYS - 1] = (step >= 1 && step < 4);
+  key_down[TOTAL_KEYS - 2] = (step >= 2 && step < 5);
+}
+
+// Fill the queue behind a held qukey, then release one key, flushing it all
+void fullQueue(uint16_t i) {
+  uint8_t step = i % (QUKEYS_QUEUE_MAX + 2);
+  key_down[0] = (step < QUKEYS_QUEUE_MAX + 1);
+  for (uint8_t j = 1; j < QUKEYS_QUEUE_MAX; j++)
+    key_down[TOTAL_KEYS - j] = (step >= j && step < QUKEYS_QUEUE_MAX);
+}
+
+struct Workload {
+  const char *name;
+  void (*step)(uint16_t i);
+};
+
+const Workload WORKLOADS[] = {
+  {"idle", idle},
+  {"typing", typing},
+  {"rollover", rollover},
+  {"full_queue", fullQueue},
+};
+
+#if QUKEYS_PROFILE
+void printTiming(const kaleidoscope::ProfileTiming &timing) {
+  Serial.print(',');
+  Serial.print(timing.calls);
+  Serial.print(',');
+  Serial.print(timing.calls ? timing.total_us * 1000 / timing.calls : 0);
+}
+#endif
+
+void run() {
+  Serial.print(F("workload,qukeys,cycles,total_us,ns_per_cycle"));
+#if QUKEYS_PROFILE
+  Serial.print(F(",flush_key_calls,flush_key_ns,lookup_qukey_calls,lookup_qukey_ns"));
+#endif
+  Serial.println();
+  for (kaleidoscope::addr::KeyAddr key_addr = 0; key_addr < MAX_TABLE_SIZE; key_addr++)
+    qukey_table[key_addr] = kaleidoscope::Qukey(0, kaleidoscope::addr::row(key_addr),
+                                                kaleidoscope::addr::col(key_addr), Key_NoKey);
+  for (const Workload &workload : WORKLOADS) {
+    for (uint8_t table_size : TABLE_SIZES) {
+      Qukeys.qukeys = qukey_table;
+      Qukeys.qukeys_count = table_size;
+      Qukeys.indexQukeys();
+#if QUKEYS_PROFILE
+      Qukeys.resetProfile();
+#endif
+      uint32_t total_us = 0;
+      for (uint16_t i = 0; i < CYCLES; i++) {
+        workload.step(i);
+        total_us += scanCycle();
+      }
+#if QUKEYS_PROFILE
+      kaleidoscope::QukeysProfile profile = Qukeys.profile();
+#endif
+      // Let go of everything before the next run
+      memset(key_down, 0, sizeof(key_down));
+      for (uint8_t i = 0; i < 4; i++)
+        scanCycle();
+
+      Serial.print(workload.name);
+      Serial.print(',');
+      Serial.print(table_size);
+      Serial.print(',');
+      Serial.print(CYCLES);
+      Serial.print(',');
+      Serial.print(total_us);
+      Serial.print(',');
+      Serial.print(total_us * 1000 / CYCLES);
+#if QUKEYS_PROFILE
+      printTiming(profile.flush_key);
+      printTiming(profile.lookup_qukey);
+#endif
+      Serial.println();
+    }
+  }
+}
+
+} // namespace bench {
+
+void setup() {
+  Serial.begin(9600);
+  Kaleidoscope.setup();
+}
+
+void loop() {
+  static bool done = false;
+  if (!done && millis() > 5000) {
+    bench::run();
+    done = true;
+  }
+  Kaleidoscope.loop();
+}
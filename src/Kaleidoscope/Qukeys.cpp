@@ -23,31 +23,54 @@
 #include <Kaleidoscope-Ranges.h>
 #include <key_defs_keymaps.h>
 
-#ifdef ARDUINO_VIRTUAL
-#define debug_print(...) printf(__VA_ARGS__)
+#if QUKEYS_TRACE_SIZE
+#define trace_event(key_addr, flags) recordTrace(key_addr, flags)
 #else
-#define debug_print(...)
+#define trace_event(key_addr, flags) do {} while (false)
 #endif
 
+// Results of `pressChordKey()`
+#define CHORD_NONE 0    // the key isn't part of a pending chord
+#define CHORD_PENDING 1 // the key is part of a chord that isn't complete yet
+#define CHORD_MATCHED 2 // the key completed a chord
+
+#if QUKEYS_STATS
+#define count_stat(counter) countStat(stats_.counter)
+#else
+#define count_stat(counter) do {} while (false)
+#endif
+
+#if QUKEYS_REPORT_LATENCY
+#define pass_latency(outcome) passLatency(outcome)
+#else
+#define pass_latency(outcome) do {} while (false)
+#endif
+
+#if QUKEYS_PROFILE
+#define profile_call(timing) ProfileTimer profile_timer(profile_.timing)
+#else
+#define profile_call(timing) do {} while (false)
+#endif
+
+// Member definitions of the Qukeys engine
+#define QUKEYS_TEMPLATE template<uint8_t Rows, uint8_t Cols, uint8_t QueueMax, typename Timer>
+#define QUKEYS_ENGINE BasicQukeys<Rows, Cols, QueueMax, Timer>
+
 
 namespace kaleidoscope {
 
 inline
 bool isDualUse(Key k) {
+  if (!QUKEYS_DUAL_USE)
+    return false;
   if (k.raw < ranges::DU_FIRST || k.raw > ranges::DU_LAST)
     return false;
   return true;
 }
 
-inline
-bool isDualUse(byte key_addr) {
-  byte row = addr::row(key_addr);
-  byte col = addr::col(key_addr);
-  Key k = Layer.lookup(row, col);
-  return isDualUse(k);
-}
-
 Key getDualUsePrimaryKey(Key k) {
+  if (!QUKEYS_DUAL_USE)
+    return k;
   if (k.raw >= ranges::DUM_FIRST && k.raw <= ranges::DUM_LAST) {
     k.raw -= ranges::DUM_FIRST;
     k.flags = 0;
@@ -59,6 +82,8 @@ Key getDualUsePrimaryKey(Key k) {
 }
 
 Key getDualUseAlternateKey(Key k) {
+  if (!QUKEYS_DUAL_USE)
+    return k;
   if (k.raw >= ranges::DUM_FIRST && k.raw <= ranges::DUM_LAST) {
     k.raw -= ranges::DUM_FIRST;
     k.raw = (k.raw >> 8) + Key_LeftControl.keyCode;
@@ -74,174 +99,1019 @@ Key getDualUseAlternateKey(Key k) {
 }
 
 
-Qukey::Qukey(int8_t layer, byte row, byte col, Key alt_keycode) {
-  this->layer = layer;
-  this->addr = addr::addr(row, col);
-  this->alt_keycode = alt_keycode;
-}
+QUKEYS_TEMPLATE Qukey * QUKEYS_ENGINE::qukeys;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::qukeys_count = 0;
+
+QUKEYS_TEMPLATE bool QUKEYS_ENGINE::active_ = true;
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::time_limit_ = 250;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::release_delay_ = 0;
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::dum_time_limit_ = 0;
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::dul_time_limit_ = 0;
+#if QUKEYS_ADAPTIVE
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::adaptive_min_ = 0;
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::adaptive_max_ = 0;
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::adaptive_streak_interval_ = 0;
+QUKEYS_TEMPLATE uint32_t QUKEYS_ENGINE::last_press_time_ = 0;
+QUKEYS_TEMPLATE typename QUKEYS_ENGINE::TapStats QUKEYS_ENGINE::tap_stats_[] = {};
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::tap_stats_next_ = 0;
+#endif
+#if QUKEYS_QUICK_TAP
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::quick_tap_window_ = 0;
+QUKEYS_TEMPLATE typename QUKEYS_ENGINE::QuickTap QUKEYS_ENGINE::quick_taps_[] = {};
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::quick_taps_next_ = 0;
+#endif
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::overflow_policy_ = QUKEYS_OVERFLOW_ALTERNATE;
+#if QUKEYS_STREAK_BYPASS
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::streak_interval_ = 0;
+QUKEYS_TEMPLATE uint32_t QUKEYS_ENGINE::last_plain_press_time_ = 0;
+#endif
+#if QUKEYS_CHORDS_MAX
+QUKEYS_TEMPLATE const Chord * QUKEYS_ENGINE::chords_ = nullptr;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::chords_count_ = 0;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::chord_masks_[] = {};
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::chord_candidates_ = 0;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::chord_length_ = 0;
+QUKEYS_TEMPLATE Timer QUKEYS_ENGINE::chord_start_ = 0;
+QUKEYS_TEMPLATE Timer QUKEYS_ENGINE::chord_deadline_ = 0;
+QUKEYS_TEMPLATE addr::KeyAddr QUKEYS_ENGINE::chord_addr_ = QUKEY_UNKNOWN_ADDR;
+QUKEYS_TEMPLATE Key QUKEYS_ENGINE::chord_keycode_;
+#endif
+QUKEYS_TEMPLATE const uint8_t * QUKEYS_ENGINE::hands_ = nullptr;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::same_hand_policy_ = QUKEYS_SAME_HAND_WAIT;
+#if QUKEYS_STATS
+QUKEYS_TEMPLATE BasicQukeysStats<QueueMax> QUKEYS_ENGINE::stats_;
+#endif
+#if QUKEYS_PROFILE
+QUKEYS_TEMPLATE QukeysProfile QUKEYS_ENGINE::profile_;
+#endif
+#if QUKEYS_REPORT_LATENCY
+QUKEYS_TEMPLATE LatencyHistogram QUKEYS_ENGINE::report_latency_[QUKEYS_LATENCY_OUTCOMES];
+QUKEYS_TEMPLATE LatencySample QUKEYS_ENGINE::latency_flushed_[QueueMax];
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::latency_flushed_count_ = 0;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::latency_passed_[QUKEYS_LATENCY_OUTCOMES];
+QUKEYS_TEMPLATE uint16_t QUKEYS_ENGINE::latency_passed_time_ = 0;
+#endif
+#if QUKEYS_TRACE_SIZE
+QUKEYS_TEMPLATE TraceRecord QUKEYS_ENGINE::trace_[QUKEYS_TRACE_SIZE];
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::trace_next_ = 0;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::trace_length_ = 0;
+QUKEYS_TEMPLATE uint32_t QUKEYS_ENGINE::trace_time_ = 0;
+#endif
+QUKEYS_TEMPLATE typename QUKEYS_ENGINE::QueueItem QUKEYS_ENGINE::key_queue_[] = {};
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::key_queue_head_ = 0;
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::key_queue_length_ = 0;
+QUKEYS_TEMPLATE byte QUKEYS_ENGINE::qukey_state_[] = {};
+#if QUKEYS_TAP_DANCE
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::tap_counts_[] = {};
+#endif
+QUKEYS_TEMPLATE bool QUKEYS_ENGINE::flushing_queue_ = false;
+#if !QUKEYS_PROGMEM_ONLY
+QUKEYS_TEMPLATE int8_t QUKEYS_ENGINE::qukey_index_[] = {};
+#endif
+QUKEYS_TEMPLATE const Qukey * QUKEYS_ENGINE::progmem_qukeys_ = nullptr;
+QUKEYS_TEMPLATE const int8_t * QUKEYS_ENGINE::progmem_qukey_first_ = nullptr;
+QUKEYS_TEMPLATE const int8_t * QUKEYS_ENGINE::progmem_qukey_next_ = nullptr;
+QUKEYS_TEMPLATE bool QUKEYS_ENGINE::flush_report_active_ = false;
+QUKEYS_TEMPLATE HID_KeyboardReport_Data_t QUKEYS_ENGINE::scan_report_;
+QUKEYS_TEMPLATE Key QUKEYS_ENGINE::held_keycodes_[QueueMax];
+QUKEYS_TEMPLATE addr::KeyAddr QUKEYS_ENGINE::held_addrs_[QueueMax];
+QUKEYS_TEMPLATE uint8_t QUKEYS_ENGINE::held_count_ = 0;
+QUKEYS_TEMPLATE bool QUKEYS_ENGINE::coalesce_reports_ = false;
+QUKEYS_TEMPLATE bool QUKEYS_ENGINE::flush_report_pending_ = false;
 
-Qukey * Qukeys::qukeys;
-uint8_t Qukeys::qukeys_count = 0;
+#if QUKEYS_PROFILE
+// Adds the time from its construction to the end of its scope to a
+// function's timing
+class ProfileTimer {
+ public:
+  explicit ProfileTimer(ProfileTiming &timing) : timing_(timing), start_(micros()) {}
+  ~ProfileTimer() {
+    timing_.calls++;
+    timing_.total_us += micros() - start_;
+  }
+ private:
+  ProfileTiming &timing_;
+  uint32_t start_;
+};
+#endif
 
-bool Qukeys::active_ = true;
-uint16_t Qukeys::time_limit_ = 250;
-uint8_t Qukeys::release_delay_ = 0;
-QueueItem Qukeys::key_queue_[] = {};
-uint8_t Qukeys::key_queue_length_ = 0;
-byte Qukeys::qukey_state_[] = {};
-bool Qukeys::flushing_queue_ = false;
+// Signed counterpart of the timer type, for comparing times
+template<typename T> struct SignedTimer;
+template<> struct SignedTimer<uint16_t> {
+  typedef int16_t type;
+};
+template<> struct SignedTimer<uint32_t> {
+  typedef int32_t type;
+};
 
-constexpr uint16_t QUKEYS_RELEASE_DELAY_OFFSET = 4096;
+// Returns true if `deadline` is in the past. This works across timer
+// wraparound, as long as deadlines are less than half the timer's range
+// away (~32s for 16 bits, ~24 days for 32).
+template<typename Timer>
+inline
+bool deadlinePassed(Timer deadline, Timer current_time) {
+  return typename SignedTimer<Timer>::type(current_time - deadline) > 0;
+}
 
 // Empty constructor; nothing is stored at the instance level
-Qukeys::Qukeys(void) {}
+QUKEYS_TEMPLATE
+QUKEYS_ENGINE::BasicQukeys(void) {}
 
-int8_t Qukeys::lookupQukey(uint8_t key_addr) {
+QUKEYS_TEMPLATE
+int8_t QUKEYS_ENGINE::lookupQukey(addr::KeyAddr key_addr) {
+  profile_call(lookup_qukey);
   if (key_addr == QUKEY_UNKNOWN_ADDR) {
     return QUKEY_NOT_FOUND;
   }
-  for (int8_t i = 0; i < qukeys_count; i++) {
-    if (qukeys[i].addr == key_addr) {
-      byte row = addr::row(key_addr);
-      byte col = addr::col(key_addr);
-      if ((qukeys[i].layer == QUKEY_ALL_LAYERS) ||
-          (qukeys[i].layer == Layer.lookupActiveLayer(row, col))) {
-        return i;
-      }
+  // Only the entries for this key need to be checked; there's more
+  // than one only if it has different qukeys on different layers
+  for (int8_t i = firstQukey(key_addr); i != QUKEY_NOT_FOUND; i = nextQukey(i)) {
+    int8_t layer = qukeyLayer(i);
+    if (layer == QUKEY_ALL_LAYERS) {
+      return i;
+    }
+    byte row = addr::row(key_addr);
+    byte col = addr::col(key_addr);
+    if (layer == Layer.lookupActiveLayer(row, col)) {
+      return i;
+    }
+  }
+  return QUKEY_NOT_FOUND;
+}
+
+#if !QUKEYS_PROGMEM_ONLY
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::indexQukeys() {
+  progmem_qukeys_ = nullptr;
+  // Stable insertion sort by addr, so qukeys for the same key are
+  // contiguous, and keep the precedence they had in the table
+  for (int8_t i = 1; i < qukeys_count; i++) {
+    Qukey qukey = qukeys[i];
+    int8_t j = i - 1;
+    while (j >= 0 && qukeys[j].addr > qukey.addr) {
+      qukeys[j + 1] = qukeys[j];
+      j--;
+    }
+    qukeys[j + 1] = qukey;
+  }
+  for (addr::KeyAddr key_addr = 0; key_addr < total_keys_; key_addr++) {
+    qukey_index_[key_addr] = QUKEY_NOT_FOUND;
+  }
+  for (int8_t i = qukeys_count - 1; i >= 0; i--) {
+    if (qukeys[i].addr < total_keys_)
+      qukey_index_[qukeys[i].addr] = i;
+  }
+}
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::setQukey(uint8_t i, const Qukey &qukey) {
+  addr::KeyAddr old_addr = qukeys[i].addr;
+  bool moving = (qukey.addr != old_addr);
+  // lookupQukey() stops at a key's qukey for all layers, so a qukey for
+  // one layer has to go ahead of it, or it would never be found
+  bool one_layer = (qukey.layer != QUKEY_ALL_LAYERS);
+  uint8_t first = i;
+  uint8_t last = i;
+  // Shift the entries in between to make room at its new place: after
+  // any other qukeys on the same key if it's moving from another key, or
+  // where it already was among them if it isn't (but ahead of the one
+  // for all layers)
+  while (i > 0 && (qukeys[i - 1].addr > qukey.addr ||
+                   (one_layer && qukeys[i - 1].addr == qukey.addr &&
+                    qukeys[i - 1].layer == QUKEY_ALL_LAYERS))) {
+    qukeys[i] = qukeys[i - 1];
+    first = --i;
+  }
+  while (i + 1 < qukeys_count &&
+         (qukeys[i + 1].addr < qukey.addr ||
+          (moving && qukeys[i + 1].addr == qukey.addr &&
+           !(one_layer && qukeys[i + 1].layer == QUKEY_ALL_LAYERS)))) {
+    qukeys[i] = qukeys[i + 1];
+    last = ++i;
+  }
+  qukeys[i] = qukey;
+  // Only keys with entries that moved need their index updated
+  indexQukey(old_addr);
+  for (i = first; i <= last; i++)
+    indexQukey(qukeys[i].addr);
+}
+
+// Point the index entry for one key at its first qukey, with a binary
+// search of the sorted table
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::indexQukey(addr::KeyAddr key_addr) {
+  if (key_addr >= total_keys_)
+    return;
+  uint8_t lower = 0;
+  uint8_t upper = qukeys_count;
+  while (lower < upper) {
+    uint8_t middle = (lower + upper) / 2;
+    if (qukeys[middle].addr < key_addr) {
+      lower = middle + 1;
+    } else {
+      upper = middle;
+    }
+  }
+  if (lower < qukeys_count && qukeys[lower].addr == key_addr) {
+    qukey_index_[key_addr] = lower;
+  } else {
+    qukey_index_[key_addr] = QUKEY_NOT_FOUND;
+  }
+}
+#endif
+
+// Time limit for a key that's being queued: its qukey's own, or the
+// one for its type of DualUse key, or the global one
+QUKEYS_TEMPLATE
+uint16_t QUKEYS_ENGINE::timeLimit(int8_t qukey_index, Key key) {
+  uint16_t time_limit = 0;
+  if (qukey_index != QUKEY_NOT_FOUND)
+    time_limit = qukeyTimeLimit(qukey_index);
+  if (time_limit == 0 && isDualUse(key)) {
+    if (key.raw >= ranges::DUM_FIRST && key.raw <= ranges::DUM_LAST) {
+      time_limit = dum_time_limit_;
+    } else if (key.raw >= ranges::DUL_FIRST && key.raw <= ranges::DUL_LAST) {
+      time_limit = dul_time_limit_;
     }
   }
+  return time_limit ? time_limit : time_limit_;
+}
+
+QUKEYS_TEMPLATE
+uint8_t QUKEYS_ENGINE::releaseDelay(int8_t qukey_index) {
+  if (qukey_index != QUKEY_NOT_FOUND) {
+    uint8_t release_delay = qukeyReleaseDelay(qukey_index);
+    if (release_delay > 0)
+      return release_delay;
+  }
+  return release_delay_;
+}
+
+#if QUKEYS_ADAPTIVE
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::setAdaptiveTimeout(uint16_t min_time_limit, uint16_t max_time_limit,
+                                uint16_t streak_interval) {
+  adaptive_min_ = min_time_limit;
+  adaptive_max_ = max_time_limit;
+  adaptive_streak_interval_ = streak_interval;
+  for (uint8_t i = 0; i < QUKEYS_TAP_STATS_SLOTS; i++) {
+    tap_stats_[i].addr = QUKEY_UNKNOWN_ADDR;
+    tap_stats_[i].tap_time = 0;
+  }
+}
+
+QUKEYS_TEMPLATE
+int8_t QUKEYS_ENGINE::findTapStats(addr::KeyAddr key_addr) {
+  for (int8_t i = 0; i < QUKEYS_TAP_STATS_SLOTS; i++) {
+    if (tap_stats_[i].addr == key_addr)
+      return i;
+  }
   return QUKEY_NOT_FOUND;
 }
 
-void Qukeys::enqueue(uint8_t key_addr) {
-  if (key_queue_length_ == QUKEYS_QUEUE_MAX) {
-    setQukeyState(key_queue_[0].addr, QUKEY_STATE_PRIMARY);
-    flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+// Called for every keypress in adaptive mode, with the time limit the
+// key would otherwise get. This is where typing streaks are detected.
+QUKEYS_TEMPLATE
+uint16_t QUKEYS_ENGINE::adaptTimeLimit(addr::KeyAddr key_addr, bool is_qukey, uint16_t time_limit) {
+  uint32_t current_time = millis();
+  bool in_streak = (current_time - last_press_time_ < adaptive_streak_interval_);
+  last_press_time_ = current_time;
+  if (!is_qukey)
+    return time_limit;
+
+  int8_t i = findTapStats(key_addr);
+  if (i == QUKEY_NOT_FOUND) {
+    // Take over the least recently allocated slot
+    i = tap_stats_next_;
+    if (++tap_stats_next_ == QUKEYS_TAP_STATS_SLOTS)
+      tap_stats_next_ = 0;
+    tap_stats_[i].addr = key_addr;
+    tap_stats_[i].tap_time = 0;
+  }
+  tap_stats_[i].press_time = current_time;
+
+  if (in_streak && tap_stats_[i].tap_time != 0) {
+    time_limit = 2 * tap_stats_[i].tap_time;
+    if (time_limit < adaptive_min_)
+      time_limit = adaptive_min_;
+    if (time_limit > adaptive_max_)
+      time_limit = adaptive_max_;
+  }
+  return time_limit;
+}
+
+// Called when a qukey is released in its primary state (i.e. tapped)
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordTap(addr::KeyAddr key_addr) {
+  int8_t i = findTapStats(key_addr);
+  if (i == QUKEY_NOT_FOUND)
+    return;
+  uint16_t tap_time = uint16_t(millis()) - tap_stats_[i].press_time;
+  if (tap_time > 255)
+    return;
+  if (tap_time == 0)
+    tap_time = 1;
+  // Exponential moving average, weighting the new tap by 1/4
+  if (tap_stats_[i].tap_time != 0)
+    tap_time = (3 * tap_stats_[i].tap_time + tap_time) / 4;
+  tap_stats_[i].tap_time = tap_time;
+}
+#endif
+
+#if QUKEYS_TRACE_SIZE
+// Add a record to the trace buffer, overwriting the oldest one if it's
+// full
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordTrace(addr::KeyAddr key_addr, uint8_t flags) {
+  uint32_t current_time = millis();
+  uint32_t delta = current_time - trace_time_;
+  trace_time_ = current_time;
+  TraceRecord &record = trace_[trace_next_];
+  record.addr = key_addr;
+  record.flags = flags;
+  record.delta = (delta > 0xFFFF) ? 0xFFFF : delta;
+  if (++trace_next_ == QUKEYS_TRACE_SIZE)
+    trace_next_ = 0;
+  if (trace_length_ < QUKEYS_TRACE_SIZE)
+    trace_length_++;
+}
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::dumpTrace() {
+  uint8_t header[] = {'Q', 'T', 2, Rows, Cols, sizeof(addr::KeyAddr), trace_length_};
+  Serial.write(header, sizeof(header));
+  uint8_t i = (trace_next_ + QUKEYS_TRACE_SIZE - trace_length_) % QUKEYS_TRACE_SIZE;
+  for (uint8_t n = 0; n < trace_length_; n++) {
+    Serial.write(reinterpret_cast<const uint8_t *>(&trace_[i]), sizeof(TraceRecord));
+    if (++i == QUKEYS_TRACE_SIZE)
+      i = 0;
+  }
+}
+#endif
+
+#if QUKEYS_STATS
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::resetStats() {
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.latency_min = 0xFFFF;
+}
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordLatency(uint16_t latency) {
+  // Once the count would saturate, halve it along with the total, so
+  // latencyAverage() stays right (it weighs older keys less from then on)
+  if (stats_.flushed == 0xFFFF) {
+    stats_.flushed /= 2;
+    stats_.latency_total /= 2;
+  }
+  stats_.flushed++;
+  if (latency < stats_.latency_min)
+    stats_.latency_min = latency;
+  if (latency > stats_.latency_max)
+    stats_.latency_max = latency;
+  stats_.latency_total += latency;
+  uint8_t bucket = 0;
+  while (latency != 0 && bucket < QUKEYS_LATENCY_BUCKETS - 1) {
+    latency >>= 1;
+    bucket++;
+  }
+  countStat(stats_.latency[bucket]);
+}
+#endif
+
+#if QUKEYS_REPORT_LATENCY
+uint16_t LatencyHistogram::percentile(uint8_t percent) const {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < QUKEYS_REPORT_LATENCY_BUCKETS; i++)
+    total += buckets[i];
+  uint32_t wanted = (total * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < QUKEYS_REPORT_LATENCY_BUCKETS - 1; i++) {
+    seen += buckets[i];
+    if (seen >= wanted) {
+      uint16_t bucket_end = (i + 1) * QUKEYS_REPORT_LATENCY_BUCKET_MS - 1;
+      return bucket_end < max ? bucket_end : max;
+    }
+  }
+  return max;
+}
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::resetReportLatency() {
+  memset(report_latency_, 0, sizeof(report_latency_));
+}
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::printReportLatency() {
+  Serial.print(F("outcome,count,max_ms,p50_ms,p90_ms,p99_ms"));
+  for (uint8_t i = 0; i < QUKEYS_REPORT_LATENCY_BUCKETS; i++) {
+    Serial.print(',');
+    Serial.print(i * QUKEYS_REPORT_LATENCY_BUCKET_MS);
+  }
+  Serial.println();
+  for (uint8_t outcome = 0; outcome < QUKEYS_LATENCY_OUTCOMES; outcome++) {
+    const LatencyHistogram &histogram = report_latency_[outcome];
+    if (outcome == QUKEYS_LATENCY_PRIMARY) {
+      Serial.print(F("primary"));
+    } else if (outcome == QUKEYS_LATENCY_ALTERNATE) {
+      Serial.print(F("alternate"));
+    } else {
+      Serial.print(F("plain"));
+    }
+    Serial.print(',');
+    Serial.print(histogram.count);
+    Serial.print(',');
+    Serial.print(histogram.max);
+    Serial.print(',');
+    Serial.print(histogram.percentile(50));
+    Serial.print(',');
+    Serial.print(histogram.percentile(90));
+    Serial.print(',');
+    Serial.print(histogram.percentile(99));
+    for (uint8_t i = 0; i < QUKEYS_REPORT_LATENCY_BUCKETS; i++) {
+      Serial.print(',');
+      Serial.print(histogram.buckets[i]);
+    }
+    Serial.println();
+  }
+}
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordReportLatency(uint16_t latency, uint8_t outcome) {
+  LatencyHistogram &histogram = report_latency_[outcome];
+  countStat(histogram.count);
+  if (latency > histogram.max)
+    histogram.max = latency;
+  uint16_t bucket = latency / QUKEYS_REPORT_LATENCY_BUCKET_MS;
+  if (bucket >= QUKEYS_REPORT_LATENCY_BUCKETS)
+    bucket = QUKEYS_REPORT_LATENCY_BUCKETS - 1;
+  countStat(histogram.buckets[bucket]);
+}
+
+// Called by flushKey() once the report for a flushed key has been sent,
+// or held back for coalescing, in which case it's measured when that gets
+// sent
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::flushedLatency(uint16_t press_time, uint8_t outcome) {
+  if (flush_report_pending_ && latency_flushed_count_ < QueueMax) {
+    latency_flushed_[latency_flushed_count_].press_time = press_time;
+    latency_flushed_[latency_flushed_count_].outcome = outcome;
+    latency_flushed_count_++;
+    return;
+  }
+  recordReportLatency(uint16_t(millis()) - press_time, outcome);
+}
+
+// Called right after the flush report has been sent
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordFlushedLatency() {
+  uint16_t current_time = millis();
+  for (uint8_t i = 0; i < latency_flushed_count_; i++)
+    recordReportLatency(current_time - latency_flushed_[i].press_time,
+                        latency_flushed_[i].outcome);
+  latency_flushed_count_ = 0;
+}
+
+// Called for a key press that doesn't get queued
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::passLatency(uint8_t outcome) {
+  if (latency_passed_[QUKEYS_LATENCY_PRIMARY] == 0 &&
+      latency_passed_[QUKEYS_LATENCY_ALTERNATE] == 0 &&
+      latency_passed_[QUKEYS_LATENCY_PLAIN] == 0)
+    latency_passed_time_ = millis();
+  if (latency_passed_[outcome] != 0xFF)
+    latency_passed_[outcome]++;
+}
+
+// Called just before the report for this scan cycle gets sent
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordPassedLatency() {
+  uint16_t latency = uint16_t(millis()) - latency_passed_time_;
+  for (uint8_t outcome = 0; outcome < QUKEYS_LATENCY_OUTCOMES; outcome++) {
+    for (; latency_passed_[outcome] > 0; latency_passed_[outcome]--)
+      recordReportLatency(latency, outcome);
+  }
+}
+#endif
+
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::enqueue(addr::KeyAddr key_addr, Key mapped_key, int8_t qukey_index,
+                     uint16_t time_limit) {
+  if (key_queue_length_ == QueueMax) {
+    count_stat(overflows);
+    // Make room by deciding the qukey at the head of the queue
+    if (queueHead().state == QUEUE_ITEM_RELEASE_DELAYED) {
+      // It's been released already; just cut its release delay short
+      setQukeyState(queueHead().addr, QUKEY_STATE_PRIMARY);
+      flushKey(QUKEY_STATE_PRIMARY, WAS_PRESSED);
+    } else if (overflow_policy_ == QUKEYS_OVERFLOW_ALTERNATE) {
+      flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
+    } else {
+      setQukeyState(queueHead().addr, QUKEY_STATE_PRIMARY);
+      flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+    }
     flushQueue();
+    sendFlushReport();
   }
   // default to alternate state to stop keys being flushed from the queue before the grace
   // period timeout
   setQukeyState(key_addr, QUKEY_STATE_ALTERNATE);
-  key_queue_[key_queue_length_].addr = key_addr;
-  key_queue_[key_queue_length_].start_time = millis();
+  QueueItem &item = queueItem(key_queue_length_);
+  item.addr = key_addr;
+  item.state = QUEUE_ITEM_PENDING;
+  item.deadline = millis() + time_limit;
+  resolveKeys(item, mapped_key, qukey_index);
+#if QUKEYS_CHORDS_MAX
+  item.is_chord = false;
+#endif
+#if QUKEYS_STATS || QUKEYS_REPORT_LATENCY
+  item.start_time = millis();
+#endif
+#if QUKEYS_STATS
+  countStat(stats_.queue_depth[key_queue_length_]);
+#endif
   key_queue_length_++;
   addr::mask(key_addr);
 }
 
-int8_t Qukeys::searchQueue(uint8_t key_addr) {
-  for (int8_t i = 0; i < key_queue_length_; i++) {
-    if (key_queue_[i].addr == key_addr)
-      return i;
+// Store a queued key's keycodes and classification, so flushing it
+// doesn't need any lookups
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::resolveKeys(QueueItem &item, Key mapped_key, int8_t qukey_index) {
+  item.release_delay = 0;
+  if (isDualUse(mapped_key)) {
+    item.is_qukey = true;
+    item.primary_keycode = getDualUsePrimaryKey(mapped_key);
+    item.alternate_keycode = getDualUseAlternateKey(mapped_key);
+    item.release_delay = releaseDelay(qukey_index);
+  } else if (qukey_index != QUKEY_NOT_FOUND) {
+    item.is_qukey = true;
+    item.primary_keycode = mapped_key;
+    item.alternate_keycode = qukeyAltKeycode(qukey_index);
+    item.release_delay = releaseDelay(qukey_index);
+#if QUKEYS_TAP_DANCE
+    // After more than one tap, it's the keycode for that many taps either
+    // way (held or not)
+    uint8_t taps = tapCount(item.addr);
+    if (taps > 1 && taps <= qukeyMaxTaps(qukey_index)) {
+      item.primary_keycode = qukeyTapKeycode(qukey_index, taps);
+      item.alternate_keycode = item.primary_keycode;
+    }
+#endif
+  } else {
+    item.is_qukey = false;
+    item.primary_keycode = mapped_key;
+    item.alternate_keycode = mapped_key;
+  }
+}
+
+// Look up the keycodes of all the keys in the queue again. Only needed
+// when flushing a key changed the active layers (e.g. a layer-shift
+// qukey that was flushed in its alternate state), because the keys
+// queued after it were pressed "on" the new layer. A key that completed
+// a chord keeps the chord's keycode.
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::resolveQueue() {
+  for (uint8_t i = 0; i < key_queue_length_; i++) {
+    QueueItem &item = queueItem(i);
+#if QUKEYS_CHORDS_MAX
+    if (item.is_chord)
+      continue;
+#endif
+    byte row = addr::row(item.addr);
+    byte col = addr::col(item.addr);
+    // Not Layer.lookup(), which still has the keycode the key got when
+    // it was pressed
+    Key mapped_key = Layer.getKey(Layer.lookupActiveLayer(row, col), row, col);
+    resolveKeys(item, mapped_key, lookupQukey(item.addr));
   }
-  return QUKEY_NOT_FOUND;
 }
 
 // flush a single entry from the head of the queue
-bool Qukeys::flushKey(bool qukey_state, uint8_t keyswitch_state) {
-  addr::unmask(key_queue_[0].addr);
-  int8_t qukey_index = lookupQukey(key_queue_[0].addr);
-  bool is_qukey = (qukey_index != QUKEY_NOT_FOUND);
-  byte row = addr::row(key_queue_[0].addr);
-  byte col = addr::col(key_queue_[0].addr);
-  bool is_dual_use = isDualUse(Layer.lookup(row, col));
-  Key keycode = Key_NoKey;
-  if (is_qukey || is_dual_use) {
+QUKEYS_TEMPLATE
+bool QUKEYS_ENGINE::flushKey(bool qukey_state, uint8_t keyswitch_state) {
+  profile_call(flush_key);
+  QueueItem &item = queueHead();
+#if QUKEYS_CHORDS_MAX
+  // If the key is part of the pending chord, that chord is off
+  if (key_queue_length_ <= chord_length_) {
+    chord_length_ = 0;
+    chord_candidates_ = 0;
+  }
+#endif
+  addr::unmask(item.addr);
+  byte row = addr::row(item.addr);
+  byte col = addr::col(item.addr);
+  Key keycode = item.primary_keycode;
+  if (item.is_qukey) {
     if (qukey_state == QUKEY_STATE_PRIMARY &&
-        getQukeyState(key_queue_[0].addr) == QUKEY_STATE_ALTERNATE) {
+        getQukeyState(item.addr) == QUKEY_STATE_ALTERNATE) {
       // If there's a release delay in effect, and there's at least one key after it in
       // the queue, delay this key's release event:
-      if (release_delay_ > 0 && key_queue_length_ > 1) {
-        key_queue_[0].start_time = millis() + QUKEYS_RELEASE_DELAY_OFFSET;
+      if (item.release_delay > 0 && key_queue_length_ > 1) {
+        item.state = QUEUE_ITEM_RELEASE_DELAYED;
+        item.deadline = millis() + item.release_delay;
         return false;
       }
     }
-    setQukeyState(key_queue_[0].addr, qukey_state);
-    if (qukey_state == QUKEY_STATE_ALTERNATE) {
-      if (is_dual_use) {
-        keycode = getDualUseAlternateKey(keycode);
-      } else { // is_qukey
-        keycode = qukeys[qukey_index].alt_keycode;
+    bool held_state = qukey_state;
+#if QUKEYS_TAP_DANCE
+    // A key that's been tapped more than once is left in its alternate
+    // state while it's held, so it keeps the keycode for that many taps;
+    // if it's been released, its dance is over
+    if (tapCount(item.addr) > 1) {
+      if (keyswitch_state & IS_PRESSED) {
+        held_state = QUKEY_STATE_ALTERNATE;
+      } else {
+        setTapCount(item.addr, 0);
       }
     }
+#endif
+    setQukeyState(item.addr, held_state);
+    if (qukey_state == QUKEY_STATE_ALTERNATE)
+      keycode = item.alternate_keycode;
+  } else {
+    // Only qukeys are left in the alternate state once flushed
+    setQukeyState(item.addr, QUKEY_STATE_PRIMARY);
   }
 
+  trace_event(item.addr, (QUKEYS_TRACE_FLUSH |
+                          (item.is_qukey ? qukey_state : QUKEYS_TRACE_PLAIN) |
+                          ((keyswitch_state & IS_PRESSED) ? QUKEYS_TRACE_HELD : 0)));
+
   // Before calling handleKeyswitchEvent() below, make sure Qukeys knows not to handle
   // these events:
   flushing_queue_ = true;
 
   // Since we're in the middle of the key scan, we don't necessarily
   // have a full HID report, and we don't want to accidentally turn
-  // off keys that the scan hasn't reached yet, so we force the
-  // current report to be the same as the previous one, then proceed
-  HID_KeyboardReport_Data_t hid_report;
-  // First, save the current report
-  memcpy(hid_report.allkeys, Keyboard.keyReport.allkeys, sizeof(hid_report));
-  // Next, copy the old report
-  memcpy(Keyboard.keyReport.allkeys, Keyboard.lastKeyReport.allkeys, sizeof(Keyboard.keyReport));
+  // off keys that the scan hasn't reached yet, so the key goes into the
+  // flush report instead, which holds the previous report (plus any
+  // keys we've already flushed)
+  if (!flush_report_active_)
+    beginFlushReport();
+  uint8_t modifiers = Keyboard.keyReport.modifiers;
   // Instead of just calling pressKey here, we start processing the
   // key again, as if it was just pressed, and mark it as injected, so
   // we can ignore it and don't start an infinite loop. It would be
   // nice if we could use key_state to also indicate which plugin
   // injected the key.
+  uint32_t layer_state = Layer.getLayerState();
   handleKeyswitchEvent(keycode, row, col, IS_PRESSED);
-  // Now we send the report (if there were any changes)
-  hid::sendKeyboardReport();
-
-  // Next, we restore the current state of the report
-  memcpy(Keyboard.keyReport.allkeys, hid_report.allkeys, sizeof(hid_report));
+  // Now we send the report (if there were any changes), or hold on to
+  // it in case the next flushed key can be added to it
+  if (coalesce_reports_) {
+    addToFlushReport(modifiers);
+  } else {
+    hid::sendKeyboardReport();
+  }
+#if QUKEYS_REPORT_LATENCY
+  if (!item.is_qukey) {
+    flushedLatency(item.start_time, QUKEYS_LATENCY_PLAIN);
+  } else if (qukey_state == QUKEY_STATE_ALTERNATE) {
+    flushedLatency(item.start_time, QUKEYS_LATENCY_ALTERNATE);
+  } else {
+    flushedLatency(item.start_time, QUKEYS_LATENCY_PRIMARY);
+  }
+#endif
 
-  // Last, if the key is still down, add its code back in
-  if (keyswitch_state & IS_PRESSED)
-    handleKeyswitchEvent(keycode, row, col, IS_PRESSED | WAS_PRESSED);
+  // If the key is still down, its code gets added back in to the scan's
+  // report by sendFlushReport()
+  if (keyswitch_state & IS_PRESSED) {
+    held_keycodes_[held_count_] = keycode;
+    held_addrs_[held_count_] = item.addr;
+    held_count_++;
+  }
 
   // Now that we're done sending the report(s), Qukeys can process events again:
   flushing_queue_ = false;
 
-  // Shift the queue, so key_queue[0] is always the first key that gets processed
-  for (byte i = 0; i < key_queue_length_; i++) {
-    key_queue_[i] = key_queue_[i + 1];
-  }
+#if QUKEYS_STATS
+  recordLatency(uint16_t(millis()) - item.start_time);
+#endif
+
+  // Pop the head of the queue; no entries need to be moved
+  if (++key_queue_head_ == QueueMax)
+    key_queue_head_ = 0;
   key_queue_length_--;
+
+  if (Layer.getLayerState() != layer_state)
+    resolveQueue();
   return true;
 }
 
+// Park the report the scan was building, and start the flush report
+// from the last report sent. This is the only time either one gets
+// copied, however many keys are flushed.
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::beginFlushReport() {
+  for (byte i = 0; i < sizeof(scan_report_.allkeys); i++) {
+    scan_report_.allkeys[i] = Keyboard.keyReport.allkeys[i];
+    Keyboard.keyReport.allkeys[i] = Keyboard.lastKeyReport.allkeys[i];
+  }
+  flush_report_active_ = true;
+  held_count_ = 0;
+}
+
+// Called by flushKey() (if coalescing is on) with the key that just got
+// flushed added to the flush report, and the report's modifiers from
+// before that. Keys can share a report as long as the host can't tell
+// the difference: any number of modifiers (or layer changes, which
+// don't touch the report) can be followed by at most one other key.
+// After that, anything else has to go in a new report, or the host
+// might reorder keys, or apply a modifier to a key that was pressed
+// before it, so a report with a new key in it is sent right away.
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::addToFlushReport(uint8_t modifiers) {
+  // Anything held back has no keys in it, so those are compared to the
+  // last report sent
+  bool keys_changed = (memcmp(Keyboard.keyReport.keys, Keyboard.lastKeyReport.keys,
+                              sizeof(Keyboard.keyReport.keys)) != 0);
+  if (!keys_changed && Keyboard.keyReport.modifiers == modifiers)
+    return;
+
+  if (flush_report_pending_)
+    count_stat(reports_saved);
+  if (keys_changed) {
+    hid::sendKeyboardReport();
+    flush_report_pending_ = false;
+#if QUKEYS_REPORT_LATENCY
+    recordFlushedLatency();
+#endif
+  } else {
+    flush_report_pending_ = true;
+  }
+}
+
+// Send the flush report, if it holds any keys that were flushed, but not
+// yet sent, then bring back the scan's report, with the flushed keys
+// that are still held. This must be called at the end of each sequence
+// of flushKey() calls, before anything else can change the report.
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::sendFlushReport() {
+  if (!flush_report_active_)
+    return;
+  if (flush_report_pending_) {
+    hid::sendKeyboardReport();
+    flush_report_pending_ = false;
+#if QUKEYS_REPORT_LATENCY
+    recordFlushedLatency();
+#endif
+  }
+  memcpy(Keyboard.keyReport.allkeys, scan_report_.allkeys, sizeof(scan_report_));
+  flush_report_active_ = false;
+
+  flushing_queue_ = true;
+  for (uint8_t i = 0; i < held_count_; i++)
+    handleKeyswitchEvent(held_keycodes_[i], addr::row(held_addrs_[i]), addr::col(held_addrs_[i]),
+                         IS_PRESSED | WAS_PRESSED);
+  flushing_queue_ = false;
+  held_count_ = 0;
+}
+
 // flushQueue() is called when a key that's in the key_queue is
 // released. This means that all the keys ahead of it in the queue are
 // still being held, so first we flush them, then we flush the
 // released key (with different parameters).
-void Qukeys::flushQueue(int8_t index) {
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::flushQueue(int8_t index) {
   if (index == QUKEY_NOT_FOUND)
     return;
   for (int8_t i = 0; i < index; i++) {
     if (key_queue_length_ == 0)
       return;
+#if QUKEYS_STATS
+    if (queueHead().is_qukey)
+      count_stat(later_releases);
+#endif
     flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
   }
-  if (isQukey(key_queue_[0].addr)) {
-    flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+#if QUKEYS_TAP_DANCE
+  // A tap-dance qukey that's tapped waits for another tap, unless it's
+  // had all its taps, or other keys are waiting behind it
+  if (key_queue_length_ == 1 && tapCount(queueHead().addr) > 0) {
+    QueueItem &item = queueHead();
+    int8_t qukey_index = lookupQukey(item.addr);
+    if (qukey_index != QUKEY_NOT_FOUND &&
+        tapCount(item.addr) < qukeyMaxTaps(qukey_index)) {
+      item.state = QUEUE_ITEM_TAPPED;
+      item.deadline = millis() + timeLimit(qukey_index, item.primary_keycode);
+      return;
+    }
+  }
+#endif
+  if (queueHead().is_qukey) {
+#if QUKEYS_ADAPTIVE
+    if (adaptive_max_ > 0)
+      recordTap(queueHead().addr);
+#endif
+#if QUKEYS_QUICK_TAP
+    if (quick_tap_window_ > 0)
+      recordQuickTap(queueHead().addr);
+#endif
+    // Count a tap, unless the release got delayed instead
+    if (flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED))
+      count_stat(taps);
   } else {
     flushKey(QUKEY_STATE_PRIMARY, WAS_PRESSED);
   }
 }
 
+#if QUKEYS_QUICK_TAP
+// Remember when a qukey was tapped, replacing the oldest entry if it
+// isn't there yet
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::recordQuickTap(addr::KeyAddr key_addr) {
+  uint8_t i = 0;
+  while (i < QUKEYS_QUICK_TAP_SLOTS && quick_taps_[i].addr != key_addr)
+    i++;
+  if (i == QUKEYS_QUICK_TAP_SLOTS) {
+    i = quick_taps_next_;
+    if (++quick_taps_next_ == QUKEYS_QUICK_TAP_SLOTS)
+      quick_taps_next_ = 0;
+    quick_taps_[i].addr = key_addr;
+  }
+  quick_taps_[i].tap_time = millis();
+}
+
+// Check if a qukey was tapped within the quick-tap window. Each tap
+// only counts once.
+QUKEYS_TEMPLATE
+bool QUKEYS_ENGINE::isQuickTap(addr::KeyAddr key_addr) {
+  for (uint8_t i = 0; i < QUKEYS_QUICK_TAP_SLOTS; i++) {
+    if (quick_taps_[i].addr == key_addr) {
+      quick_taps_[i].addr = QUKEY_UNKNOWN_ADDR;
+      return (uint16_t(millis()) - quick_taps_[i].tap_time < quick_tap_window_);
+    }
+  }
+  return false;
+}
+#endif
+
+// Let a qukey that was just pressed through in its primary state,
+// without queueing it
+QUKEYS_TEMPLATE
+EventHandlerResult QUKEYS_ENGINE::skipQueue(addr::KeyAddr key_addr, Key &mapped_key) {
+  setQukeyState(key_addr, QUKEY_STATE_PRIMARY);
+  trace_event(key_addr, QUKEYS_TRACE_FLUSH | QUKEY_STATE_PRIMARY | QUKEYS_TRACE_HELD);
+  pass_latency(QUKEYS_LATENCY_PRIMARY);
+  mapped_key = getDualUsePrimaryKey(mapped_key);
+  return EventHandlerResult::OK;
+}
+
+#if QUKEYS_CHORDS_MAX
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::setChords(const Chord *chords, uint8_t count) {
+  chords_ = chords;
+  chords_count_ = count;
+  memset(chord_masks_, 0, sizeof(chord_masks_));
+  for (uint8_t c = 0; c < count; c++) {
+    for (uint8_t i = 0; i < chordSize(c); i++) {
+      if (chords[c].keys[i] < total_keys_)
+        bitSet(chord_masks_[chords[c].keys[i]], c);
+    }
+  }
+}
+
+// Add a key that was just pressed to the pending chord, or start a new
+// one with it. The key gets queued unless it completes a chord.
+QUKEYS_TEMPLATE
+uint8_t QUKEYS_ENGINE::pressChordKey(addr::KeyAddr key_addr) {
+  uint8_t chords = chord_masks_[key_addr];
+  // The pending chord may have run out of time since the last scan
+  if (chord_candidates_ != 0 && deadlinePassed<Timer>(chord_deadline_, millis()))
+    cancelChord();
+  if (chord_candidates_ != 0) {
+    uint8_t candidates = chord_candidates_ & chords;
+    if (candidates == 0) {
+      // This key isn't part of any chord the pending keys could be
+      cancelChord();
+    } else {
+      chord_candidates_ = candidates;
+      // All the keys pressed so far, this one included, are in each of
+      // the candidates, so a candidate with as many keys as that is
+      // complete (the first one in the table wins)
+      Timer elapsed = millis() - chord_start_;
+      for (uint8_t c = 0; c < chords_count_; c++) {
+        if (bitRead(candidates, c) && chordSize(c) == chord_length_ + 1 &&
+            elapsed <= chords_[c].time_limit) {
+          matchChord(c, key_addr);
+          return CHORD_MATCHED;
+        }
+      }
+      return CHORD_PENDING;
+    }
+  }
+  if (chords == 0)
+    return CHORD_NONE;
+
+  chord_candidates_ = chords;
+  chord_length_ = 0;
+  chord_start_ = millis();
+  uint8_t time_limit = 0;
+  for (uint8_t c = 0; c < chords_count_; c++) {
+    if (bitRead(chords, c) && chords_[c].time_limit > time_limit)
+      time_limit = chords_[c].time_limit;
+  }
+  chord_deadline_ = chord_start_ + time_limit;
+  return CHORD_PENDING;
+}
+
+// The other keys of the chord are the last ones in the queue; drop them,
+// leaving them masked until they're released, and let the key that
+// completed it produce the chord's keycode
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::matchChord(uint8_t chord, addr::KeyAddr key_addr) {
+  for (uint8_t i = 0; i < chord_length_; i++) {
+    key_queue_length_--;
+    setQukeyState(queueItem(key_queue_length_).addr, QUKEY_STATE_PRIMARY);
+  }
+  chord_length_ = 0;
+  chord_candidates_ = 0;
+  chord_addr_ = key_addr;
+  chord_keycode_ = chords_[chord].keycode;
+}
+
+// Give up on the pending chord; its keys stay queued as ordinary keys
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::cancelChord() {
+  chord_length_ = 0;
+  chord_candidates_ = 0;
+  flushQueue();
+  sendFlushReport();
+}
+#endif
+
+// Decide the state of pending qukeys at the head of the queue by which
+// hand the key that was just pressed is on: alternate if it's on the
+// other hand, primary if it's on the same hand (depending on the
+// policy). Stops at the first qukey it can't decide.
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::decideByHand(addr::KeyAddr key_addr) {
+  uint8_t hand = keyHand(key_addr);
+  if (hand == QUKEY_HAND_NONE)
+    return;
+  while (key_queue_length_ > 0 && queueHead().state == QUEUE_ITEM_PENDING) {
+    uint8_t qukey_hand = keyHand(queueHead().addr);
+    if (qukey_hand == QUKEY_HAND_NONE)
+      break;
+    if (qukey_hand != hand) {
+      count_stat(opposite_hand);
+      flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
+    } else if (same_hand_policy_ == QUKEYS_SAME_HAND_PRIMARY) {
+      count_stat(same_hand);
+      // It's still held, so no release delay applies
+      setQukeyState(queueHead().addr, QUKEY_STATE_PRIMARY);
+      flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED);
+    } else {
+      break;
+    }
+    flushQueue();
+  }
+  sendFlushReport();
+}
+
+#if QUKEYS_TAP_DANCE
+// The tap-dance qukey waiting at the head of the queue was pressed
+// again; it waits to be decided once more, as its next tap
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::continueTapDance(Key mapped_key, int8_t qukey_index) {
+  QueueItem &item = queueHead();
+  setTapCount(item.addr, tapCount(item.addr) + 1);
+  setQukeyState(item.addr, QUKEY_STATE_ALTERNATE);
+  item.state = QUEUE_ITEM_PENDING;
+  item.deadline = millis() + timeLimit(qukey_index, mapped_key);
+  resolveKeys(item, mapped_key, qukey_index);
+  addr::mask(item.addr);
+}
+
+// The tap-dance qukey waiting at the head of the queue is done: flush it
+// as a tap of the keycode for the number of taps it got
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::finishTapDance() {
+  addr::KeyAddr key_addr = queueHead().addr;
+  count_stat(taps);
+  setQukeyState(key_addr, QUKEY_STATE_PRIMARY);
+  flushKey(QUKEY_STATE_PRIMARY, WAS_PRESSED);
+  setTapCount(key_addr, 0);
+}
+#endif
+
 // Flush all the non-qukey keys from the front of the queue
-void Qukeys::flushQueue() {
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::flushQueue() {
   // flush keys until we find a qukey:
-  while (key_queue_length_ > 0 && !isQukey(key_queue_[0].addr)) {
+  while (key_queue_length_ > 0 && !queueHead().is_qukey) {
     if (flushKey(QUKEY_STATE_PRIMARY, IS_PRESSED | WAS_PRESSED) == false)
       break;
   }
 }
 
-inline
-bool Qukeys::isQukey(uint8_t addr) {
-  return (isDualUse(addr) || lookupQukey(addr) != QUKEY_NOT_FOUND);
-}
-
-EventHandlerResult Qukeys::onKeyswitchEvent(Key &mapped_key, byte row, byte col, uint8_t key_state) {
+QUKEYS_TEMPLATE
+EventHandlerResult QUKEYS_ENGINE::onKeyswitchEvent(Key &mapped_key, byte row, byte col, uint8_t key_state) {
 
   // If key_addr is not a physical key, ignore it; some other plugin injected it
-  if (row >= ROWS || col >= COLS || (key_state & INJECTED) != 0)
+  if (row >= Rows || col >= Cols || (key_state & INJECTED) != 0)
     return EventHandlerResult::OK;
 
   // If Qukeys is turned off, continue to next plugin
@@ -250,8 +1120,42 @@ EventHandlerResult Qukeys::onKeyswitchEvent(Key &mapped_key, byte row, byte col,
     return EventHandlerResult::OK;
   }
 
-  // get key addr & qukey (if any)
-  uint8_t key_addr = addr::addr(row, col);
+  // If the key isn't active, and didn't just toggle off, continue to next plugin
+  if (!keyIsPressed(key_state) && !keyWasPressed(key_state)) {
+    mapped_key = getDualUsePrimaryKey(mapped_key);
+    return EventHandlerResult::OK;
+  }
+
+  addr::KeyAddr key_addr = addr::addr(row, col);
+
+  // Record physical key presses and releases (not the ones we inject
+  // while flushing the queue)
+  if (!flushing_queue_ && (keyToggledOn(key_state) || keyToggledOff(key_state)))
+    trace_event(key_addr, keyToggledOn(key_state) ? QUKEYS_TRACE_PRESS : 0);
+
+#if QUKEYS_CHORDS_MAX
+  // The key that completed a chord produces the chord's keycode
+  if (key_addr == chord_addr_ && !flushing_queue_ && !keyToggledOn(key_state)) {
+    if (keyToggledOff(key_state))
+      chord_addr_ = QUKEY_UNKNOWN_ADDR;
+    if (searchQueue(key_addr) == QUKEY_NOT_FOUND) {
+      mapped_key = chord_keycode_;
+      return EventHandlerResult::OK;
+    }
+  }
+#endif
+
+  // If the queue is empty, a key that's held or released can only need
+  // a different keycode if it's a qukey in its alternate state (only
+  // qukeys are ever left in that state), or a DualUse key
+  if (key_queue_length_ == 0 && !flushing_queue_ &&
+      !keyToggledOn(key_state) &&
+      getQukeyState(key_addr) == QUKEY_STATE_PRIMARY &&
+      !isDualUse(mapped_key)) {
+    return EventHandlerResult::OK;
+  }
+
+  // get qukey (if any)
   int8_t qukey_index = lookupQukey(key_addr);
 
   // If the key was injected (from the queue being flushed)
@@ -268,23 +1172,105 @@ EventHandlerResult Qukeys::onKeyswitchEvent(Key &mapped_key, byte row, byte col,
     return EventHandlerResult::OK;
   }
 
-  // If the key isn't active, and didn't just toggle off, continue to next plugin
-  if (!keyIsPressed(key_state) && !keyWasPressed(key_state)) {
-    mapped_key = getDualUsePrimaryKey(mapped_key);
-    return EventHandlerResult::OK;
-  }
-
   // If the key was just pressed:
   if (keyToggledOn(key_state)) {
+#if QUKEYS_TAP_DANCE
+    // If a tap-dance qukey is waiting for another tap, this is it, or
+    // its dance is over
+    if (key_queue_length_ > 0 && queueHead().state == QUEUE_ITEM_TAPPED) {
+      if (queueHead().addr == key_addr && qukey_index != QUKEY_NOT_FOUND) {
+        continueTapDance(mapped_key, qukey_index);
+        return EventHandlerResult::EVENT_CONSUMED;
+      }
+      finishTapDance();
+      flushQueue();
+      sendFlushReport();
+    }
+#endif
+    uint8_t chord = CHORD_NONE;
+#if QUKEYS_CHORDS_MAX
+    // (only one chord can be held at a time)
+    if (chords_count_ > 0 && chord_addr_ == QUKEY_UNKNOWN_ADDR) {
+      chord = pressChordKey(key_addr);
+      if (chord == CHORD_MATCHED) {
+        if (key_queue_length_ == 0) {
+          setQukeyState(key_addr, QUKEY_STATE_PRIMARY);
+          mapped_key = chord_keycode_;
+          pass_latency(QUKEYS_LATENCY_PLAIN);
+          return EventHandlerResult::OK;
+        }
+        enqueue(key_addr, chord_keycode_, QUKEY_NOT_FOUND, time_limit_);
+        queueItem(key_queue_length_ - 1).is_chord = true;
+        return EventHandlerResult::EVENT_CONSUMED;
+      }
+    }
+#endif
+
+    // A keypress on one hand can decide the qukeys queued on the other
+    if (hands_ != nullptr && key_queue_length_ > 0 && chord == CHORD_NONE)
+      decideByHand(key_addr);
+
+    bool is_qukey = (qukey_index != QUKEY_NOT_FOUND || isDualUse(mapped_key));
+#if QUKEYS_TAP_DANCE
+    if (isTapDance(qukey_index))
+      setTapCount(key_addr, 1);
+#endif
+    uint16_t time_limit = is_qukey ? timeLimit(qukey_index, mapped_key) : time_limit_;
+#if QUKEYS_ADAPTIVE
+    if (adaptive_max_ > 0)
+      time_limit = adaptTimeLimit(key_addr, is_qukey, time_limit);
+#endif
+
+#if QUKEYS_CHORDS_MAX
+    // A key in a pending chord has to wait for the chord to be decided
+    // (pressChordKey() has cancelled the chord if its deadline passed)
+    if (chord == CHORD_PENDING) {
+      if (!is_qukey)
+        time_limit = chord_deadline_ - Timer(millis());
+      enqueue(key_addr, mapped_key, qukey_index, time_limit);
+      // Unless making room in the queue flushed the chord's first key
+      if (chord_candidates_ != 0)
+        chord_length_++;
+      return EventHandlerResult::EVENT_CONSUMED;
+    }
+#endif
+
+#if QUKEYS_QUICK_TAP
+    // A qukey pressed again right after a tap is being held to repeat
+    // its primary keycode
+    if (is_qukey && key_queue_length_ == 0 && quick_tap_window_ > 0 &&
+        !isTapDance(qukey_index) && isQuickTap(key_addr)) {
+      count_stat(quick_taps);
+      return skipQueue(key_addr, mapped_key);
+    }
+#endif
+
+#if QUKEYS_STREAK_BYPASS
+    // In a typing streak, a qukey is most likely being tapped, so
+    // unless there are keys queued ahead of it, it can skip the queue
+    if (streak_interval_ > 0) {
+      uint32_t current_time = millis();
+      if (!is_qukey) {
+        last_plain_press_time_ = current_time;
+      } else if (key_queue_length_ == 0 &&
+                 current_time - last_plain_press_time_ < streak_interval_ &&
+                 !isTapDance(qukey_index)) {
+        count_stat(streak_bypassed);
+        return skipQueue(key_addr, mapped_key);
+      } else {
+        count_stat(streak_queued);
+      }
+    }
+#endif
+
     // If the queue is empty and the key isn't a qukey, proceed:
-    if (key_queue_length_ == 0 &&
-        ! isDualUse(mapped_key) &&
-        qukey_index == QUKEY_NOT_FOUND) {
+    if (key_queue_length_ == 0 && !is_qukey) {
+      pass_latency(QUKEYS_LATENCY_PLAIN);
       return EventHandlerResult::OK;
     }
 
     // Otherwise, queue the key and stop processing:
-    enqueue(key_addr);
+    enqueue(key_addr, mapped_key, qukey_index, time_limit);
     // flushQueue() has already handled this key release
     return EventHandlerResult::EVENT_CONSUMED;
   }
@@ -305,13 +1291,31 @@ EventHandlerResult Qukeys::onKeyswitchEvent(Key &mapped_key, byte row, byte col,
         }
       } else if (qukey_index != QUKEY_NOT_FOUND) {
         if (getQukeyState(key_addr) == QUKEY_STATE_ALTERNATE) {
-          mapped_key = qukeys[qukey_index].alt_keycode;
+          mapped_key = heldAltKeycode(key_addr, qukey_index);
         }
+#if QUKEYS_TAP_DANCE
+        setTapCount(key_addr, 0);
+#endif
       }
       return EventHandlerResult::OK;
     }
+#if QUKEYS_CHORDS_MAX
+    // Releasing a key in the queue means no chord can be completed
+    chord_length_ = 0;
+    chord_candidates_ = 0;
+#endif
     flushQueue(queue_index);
     flushQueue();
+    sendFlushReport();
+#if QUKEYS_TAP_DANCE
+    // A tapped tap-dance qukey stays in the queue, waiting for the next tap
+    if (key_queue_length_ > 0 && queueHead().state == QUEUE_ITEM_TAPPED)
+      return EventHandlerResult::EVENT_CONSUMED;
+    // Otherwise its dance is over, unless its release was delayed, in
+    // which case it's still at the head of the queue
+    if (key_queue_length_ == 0 || queueHead().addr != key_addr)
+      setTapCount(key_addr, 0);
+#endif
     mapped_key = getDualUsePrimaryKey(mapped_key);
     return EventHandlerResult::OK;
   }
@@ -336,7 +1340,7 @@ EventHandlerResult Qukeys::onKeyswitchEvent(Key &mapped_key, byte row, byte col,
       if (isDualUse(mapped_key)) {
         mapped_key = getDualUseAlternateKey(mapped_key);
       } else {
-        mapped_key = qukeys[qukey_index].alt_keycode;
+        mapped_key = heldAltKeycode(key_addr, qukey_index);
       }
     } else { // qukey_state == QUKEY_STATE_PRIMARY
       mapped_key = getDualUsePrimaryKey(mapped_key);
@@ -348,70 +1352,110 @@ EventHandlerResult Qukeys::onKeyswitchEvent(Key &mapped_key, byte row, byte col,
   return EventHandlerResult::EVENT_CONSUMED;
 }
 
-EventHandlerResult Qukeys::beforeReportingState() {
+QUKEYS_TEMPLATE
+EventHandlerResult QUKEYS_ENGINE::beforeReportingState() {
 
-  uint16_t current_time = millis();
+#if QUKEYS_REPORT_LATENCY
+  recordPassedLatency();
+#endif
 
-  if (release_delay_ > 0 && key_queue_length_ > 0) {
-    int16_t diff_time = key_queue_[0].start_time - current_time;
-    if (diff_time > 0) {
-      int16_t delay_window = QUKEYS_RELEASE_DELAY_OFFSET - release_delay_;
-      if (diff_time < delay_window) {
-        setQukeyState(key_queue_[0].addr, QUKEY_STATE_PRIMARY);
-        flushKey(QUKEY_STATE_PRIMARY, WAS_PRESSED);
-        flushQueue();
-      }
-      return EventHandlerResult::OK;
-    }
-  }
+  // Nothing to do if there are no keys waiting in the queue
+  if (key_queue_length_ == 0)
+    return EventHandlerResult::OK;
 
-  // If the qukey has been held longer than the time limit, set its
-  // state to the alternate keycode and add it to the report
-  while (key_queue_length_ > 0) {
-    if ((current_time - key_queue_[0].start_time) > time_limit_) {
-      flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
-      flushQueue();
+  Timer current_time = millis();
+
+#if QUKEYS_CHORDS_MAX
+  if (chord_candidates_ != 0 && deadlinePassed(chord_deadline_, current_time))
+    cancelChord();
+#endif
+
+  // Only the key at the head of the queue can be flushed, so its
+  // deadline is the only one that matters. When it passes, a pending
+  // key gets its alternate state, a qukey whose release was delayed
+  // gets its primary state, and a tapped tap-dance qukey is done.
+  while (key_queue_length_ > 0 &&
+         deadlinePassed(queueHead().deadline, current_time)) {
+    if (queueHead().state == QUEUE_ITEM_RELEASE_DELAYED) {
+      count_stat(release_delays);
+      setQukeyState(queueHead().addr, QUKEY_STATE_PRIMARY);
+      flushKey(QUKEY_STATE_PRIMARY, WAS_PRESSED);
+#if QUKEYS_TAP_DANCE
+    } else if (queueHead().state == QUEUE_ITEM_TAPPED) {
+      finishTapDance();
+#endif
     } else {
-      break;
+      count_stat(timeouts);
+      flushKey(QUKEY_STATE_ALTERNATE, IS_PRESSED | WAS_PRESSED);
     }
+    flushQueue();
   }
+  sendFlushReport();
 
   return EventHandlerResult::OK;
 }
 
-EventHandlerResult Qukeys::onSetup() {
+QUKEYS_TEMPLATE
+EventHandlerResult QUKEYS_ENGINE::onSetup() {
   // initializing the key_queue seems unnecessary, actually
-  for (int8_t i = 0; i < QUKEYS_QUEUE_MAX; i++) {
+  for (int8_t i = 0; i < QueueMax; i++) {
     key_queue_[i].addr = QUKEY_UNKNOWN_ADDR;
-    key_queue_[i].start_time = 0;
+    key_queue_[i].state = QUEUE_ITEM_PENDING;
+    key_queue_[i].deadline = 0;
   }
+  key_queue_head_ = 0;
   key_queue_length_ = 0;
 
+#if QUKEYS_QUICK_TAP
+  for (uint8_t i = 0; i < QUKEYS_QUICK_TAP_SLOTS; i++)
+    quick_taps_[i].addr = QUKEY_UNKNOWN_ADDR;
+#endif
+
+#if !QUKEYS_PROGMEM_ONLY
+  if (progmem_qukeys_ == nullptr)
+    indexQukeys();
+#endif
+
+#if QUKEYS_STATS
+  resetStats();
+#endif
+#if QUKEYS_REPORT_LATENCY
+  resetReportLatency();
+#endif
+
   return EventHandlerResult::OK;
 }
 
 // Legacy V1 API
 #if KALEIDOSCOPE_ENABLE_V1_PLUGIN_API
-void Qukeys::begin() {
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::begin() {
   onSetup();
   Kaleidoscope.useEventHandlerHook(legacyEventHandler);
   Kaleidoscope.useLoopHook(legacyLoopHook);
 }
 
-Key Qukeys::legacyEventHandler(Key mapped_key, byte row, byte col, uint8_t key_state) {
-  EventHandlerResult r = ::Qukeys.onKeyswitchEvent(mapped_key, row, col, key_state);
+QUKEYS_TEMPLATE
+Key QUKEYS_ENGINE::legacyEventHandler(Key mapped_key, byte row, byte col, uint8_t key_state) {
+  // The state is all static, so any instance will do
+  EventHandlerResult r = BasicQukeys().onKeyswitchEvent(mapped_key, row, col, key_state);
   if (r == EventHandlerResult::OK)
     return mapped_key;
   return Key_NoKey;
 }
 
-void Qukeys::legacyLoopHook(bool is_post_clear) {
+QUKEYS_TEMPLATE
+void QUKEYS_ENGINE::legacyLoopHook(bool is_post_clear) {
   if (is_post_clear)
     return;
-  ::Qukeys.beforeReportingState();
+  BasicQukeys().beforeReportingState();
 }
 #endif
 
+// The engine for the whole keyboard; any other instantiation needs its
+// own, with these definitions
+template class BasicQukeys<ROWS, COLS, QUKEYS_QUEUE_MAX, QUKEYS_TIMER_TYPE>;
+
 } // namespace kaleidoscope {
 
 kaleidoscope::Qukeys Qukeys;
@@ -21,9 +21,109 @@
 #include <Kaleidoscope.h>
 #include <addr.h>
 #include <Kaleidoscope-Ranges.h>
+#include <MultiReport/Keyboard.h>
 
-// Maximum length of the pending queue
+// Maximum length of the pending queue (can be overridden at compile time)
+#ifndef QUKEYS_QUEUE_MAX
 #define QUKEYS_QUEUE_MAX 8
+#endif
+// Set to 1 to compile in adaptive time limits (see
+// `Qukeys.setAdaptiveTimeout()`). When it's 0, their code and state
+// aren't compiled at all.
+#ifndef QUKEYS_ADAPTIVE
+#define QUKEYS_ADAPTIVE 0
+#endif
+// Number of keys for which adaptive time limit statistics are kept
+#ifndef QUKEYS_TAP_STATS_SLOTS
+#define QUKEYS_TAP_STATS_SLOTS 8
+#endif
+// Set to 1 to compile in the typing streak bypass (see
+// `Qukeys.setStreakBypass()`). When it's 0, its code and state aren't
+// compiled at all.
+#ifndef QUKEYS_STREAK_BYPASS
+#define QUKEYS_STREAK_BYPASS 0
+#endif
+// Set to 1 to compile in the quick-tap window (see
+// `Qukeys.setQuickTapWindow()`). When it's 0, its code and state aren't
+// compiled at all.
+#ifndef QUKEYS_QUICK_TAP
+#define QUKEYS_QUICK_TAP 0
+#endif
+// Number of recently tapped qukeys remembered for the quick-tap window
+#ifndef QUKEYS_QUICK_TAP_SLOTS
+#define QUKEYS_QUICK_TAP_SLOTS 4
+#endif
+// Set to 1 to collect decision statistics (see `Qukeys.stats()`). When
+// it's 0, the statistics code isn't compiled at all.
+#ifndef QUKEYS_STATS
+#define QUKEYS_STATS 0
+#endif
+// Number of buckets in the queue latency histogram
+#define QUKEYS_LATENCY_BUCKETS 11
+// Set to 1 to measure the time from each key press to the first HID
+// report it shows up in (see `Qukeys.reportLatency()`). When it's 0,
+// the measuring code isn't compiled at all.
+#ifndef QUKEYS_REPORT_LATENCY
+#define QUKEYS_REPORT_LATENCY 0
+#endif
+// Width (in ms) and number of the buckets in each report latency
+// histogram; the last bucket counts everything longer
+#ifndef QUKEYS_REPORT_LATENCY_BUCKET_MS
+#define QUKEYS_REPORT_LATENCY_BUCKET_MS 16
+#endif
+#ifndef QUKEYS_REPORT_LATENCY_BUCKETS
+#define QUKEYS_REPORT_LATENCY_BUCKETS 16
+#endif
+// Maximum number of chords (see `CHORDS()`), up to 8. When it's 0, the
+// chord code isn't compiled at all; otherwise it takes TOTAL_KEYS bytes
+// of SRAM for the chord masks.
+#ifndef QUKEYS_CHORDS_MAX
+#define QUKEYS_CHORDS_MAX 0
+#endif
+// Set to 1 to let qukeys have extra keycodes for two and three taps in
+// a row (see `Qukey`); when it's 0, the tap-dance code isn't compiled
+// at all. It isn't free, even for qukeys that don't dance:
+// - every qukey gets 4 more bytes for the tap keycodes (in PROGMEM, SRAM
+//   and EEPROM alike), and the tap counts take TOTAL_KEYS / 4 bytes of
+//   SRAM
+// - every key press checks whether the head of the queue is a tapped
+//   qukey waiting for another tap
+// - every qukey press looks up how many taps it can take (reading its
+//   tap keycodes)
+// - releasing a queued key checks the head of the queue again (O(1)) to
+//   tell whether its dance is over
+// See "Tap dance" in README.md.
+#ifndef QUKEYS_TAP_DANCE
+#define QUKEYS_TAP_DANCE 0
+#endif
+// Number of records in the event trace buffer (see `Qukeys.dumpTrace()`),
+// up to 255. Each record takes 4 bytes of SRAM (5 with 16-bit addrs); 0
+// turns tracing off.
+#ifndef QUKEYS_TRACE_SIZE
+#define QUKEYS_TRACE_SIZE 0
+#endif
+// Set to 1 to time each call of flushKey() and lookupQukey() (see
+// `Qukeys.profile()`); the benchmark example uses it. It's only meant
+// for benchmarking: it adds two calls to micros() to each of them.
+#ifndef QUKEYS_PROFILE
+#define QUKEYS_PROFILE 0
+#endif
+// Type used for queue deadlines. `uint16_t` saves two bytes per queue
+// entry, but then time limits and release delays must stay below ~32s.
+#ifndef QUKEYS_TIMER_TYPE
+#define QUKEYS_TIMER_TYPE uint32_t
+#endif
+// Set to 0 to compile out support for DualUse keys (`MT()`, `LT()`, etc.)
+// in the keymap, if you only use `QUKEYS()`
+#ifndef QUKEYS_DUAL_USE
+#define QUKEYS_DUAL_USE 1
+#endif
+// Set to 1 if the qukeys are only ever defined with `QUKEYS_PROGMEM()`,
+// to compile out `QUKEYS()` and the per-key index it needs in SRAM
+// (TOTAL_KEYS bytes)
+#ifndef QUKEYS_PROGMEM_ONLY
+#define QUKEYS_PROGMEM_ONLY 0
+#endif
 // Total number of keys on the keyboard (assuming full grid)
 #define TOTAL_KEYS ROWS * COLS
 
@@ -34,7 +134,7 @@
 // Initialization addr value for empty key_queue. This seems to be
 // unnecessary, because we rely on keeping track of the lenght of the
 // queue, anyway.
-#define QUKEY_UNKNOWN_ADDR 0xFF
+#define QUKEY_UNKNOWN_ADDR kaleidoscope::addr::KeyAddr(~0)
 // Value to return when no match is found in Qukeys.dict. A successful
 // match returns an index in the array, so this must be negative. Also
 // used for failed search of the key_queue.
@@ -42,6 +142,34 @@
 // Wildcard value; this matches any layer
 #define QUKEY_ALL_LAYERS -1
 
+// Which hand a key is on, for `QUKEYS_HANDS()`. Keys on neither hand
+// (e.g. in the middle of the keyboard) never decide a qukey's state early.
+#define QUKEY_HAND_NONE 0
+#define QUKEY_HAND_LEFT 1
+#define QUKEY_HAND_RIGHT 2
+
+// What happens to the qukey at the head of the queue when a key is
+// pressed while the queue is full. Every key queued behind it is still
+// held at that point, so unless the qukey itself is released before all
+// of them, the queue would decide it in its alternate state anyway;
+// primary is what Qukeys used to do.
+#define QUKEYS_OVERFLOW_ALTERNATE 0 // it gets its alternate keycode (the default)
+#define QUKEYS_OVERFLOW_PRIMARY 1   // it gets its primary keycode
+
+// What a key press on the same hand as a pending qukey does to it
+#define QUKEYS_SAME_HAND_WAIT 0    // nothing; wait for a timeout or release
+#define QUKEYS_SAME_HAND_PRIMARY 1 // the qukey gets its primary keycode
+
+// Values for QueueItem::state. A pending key gets flushed in its
+// alternate state at its deadline (the time limit); a qukey whose
+// release has been delayed gets flushed in its primary state (unless a
+// subsequent key is released first). Keys leave the queue as soon as
+// their state is decided.
+#define QUEUE_ITEM_PENDING 0
+#define QUEUE_ITEM_RELEASE_DELAYED 1
+// A tap-dance qukey that was tapped, waiting to be tapped again
+#define QUEUE_ITEM_TAPPED 2
+
 #define MT(mod, key) (Key) { \
     .raw = kaleidoscope::ranges::DUM_FIRST + \
       (((Key_ ## mod).keyCode - Key_LeftControl.keyCode) << 8) + (Key_ ## key).keyCode }
@@ -54,32 +182,254 @@
 
 namespace kaleidoscope {
 
-// Data structure for an individual qukey
+// Data structure for an individual qukey (7 bytes, or 8 with 16-bit
+// addrs, and 4 more with QUKEYS_TAP_DANCE). A `time_limit` or
+// `release_delay` of zero means the global setting is used.
 struct Qukey {
  public:
   Qukey(void) {}
-  Qukey(int8_t layer, byte row, byte col, Key alt_keycode);
+  constexpr Qukey(int8_t layer, byte row, byte col, Key alt_keycode,
+                  uint16_t time_limit = 0, uint8_t release_delay = 0)
+    : layer(layer), addr(addr::addr(row, col)), alt_keycode(alt_keycode),
+      time_limit(time_limit), release_delay(release_delay)
+#if QUKEYS_TAP_DANCE
+    , tap_keycodes{Key_NoKey, Key_NoKey}
+#endif
+  {}
+#if QUKEYS_TAP_DANCE
+  // A tap-dance qukey: tapped two (or three) times in a row, each tap
+  // within its time limit of the last, it produces `double_tap_keycode`
+  // (or `triple_tap_keycode`) instead, and held on the last tap, it
+  // holds that keycode. `double_tap_keycode` can't be Key_NoKey (a
+  // triple tap keycode on its own is ignored).
+  constexpr Qukey(int8_t layer, byte row, byte col, Key alt_keycode,
+                  uint16_t time_limit, uint8_t release_delay,
+                  Key double_tap_keycode, Key triple_tap_keycode = Key_NoKey)
+    : layer(layer), addr(addr::addr(row, col)), alt_keycode(alt_keycode),
+      time_limit(time_limit), release_delay(release_delay),
+      tap_keycodes{double_tap_keycode, triple_tap_keycode} {}
+#endif
 
   int8_t layer;
-  uint8_t addr;
+  addr::KeyAddr addr;
   Key alt_keycode;
+  uint16_t time_limit;
+  uint8_t release_delay;
+#if QUKEYS_TAP_DANCE
+  Key tap_keycodes[2]; // for two and three taps; Key_NoKey if unused
+#endif
+};
+
+#if QUKEYS_CHORDS_MAX
+// A chord: two to four keys, pressed within `time_limit` ms of the first
+// one (in any order), produce `keycode` instead of their own keycodes.
+// The chord's keycode stays pressed while the key that completed it is
+// held; the other keys do nothing more until they're released. A chord
+// matches as soon as all its keys are down, so a chord whose keys are
+// all part of a bigger one wins unless one of the bigger chord's other
+// keys is pressed first.
+struct Chord {
+  constexpr Chord(Key keycode, uint8_t time_limit,
+                  byte row1, byte col1, byte row2, byte col2)
+    : keycode(keycode), time_limit(time_limit),
+      keys{addr::addr(row1, col1), addr::addr(row2, col2),
+           QUKEY_UNKNOWN_ADDR, QUKEY_UNKNOWN_ADDR} {}
+  constexpr Chord(Key keycode, uint8_t time_limit,
+                  byte row1, byte col1, byte row2, byte col2, byte row3, byte col3)
+    : keycode(keycode), time_limit(time_limit),
+      keys{addr::addr(row1, col1), addr::addr(row2, col2),
+           addr::addr(row3, col3), QUKEY_UNKNOWN_ADDR} {}
+  constexpr Chord(Key keycode, uint8_t time_limit,
+                  byte row1, byte col1, byte row2, byte col2,
+                  byte row3, byte col3, byte row4, byte col4)
+    : keycode(keycode), time_limit(time_limit),
+      keys{addr::addr(row1, col1), addr::addr(row2, col2),
+           addr::addr(row3, col3), addr::addr(row4, col4)} {}
+
+  Key keycode;
+  uint8_t time_limit;
+  addr::KeyAddr keys[4]; // unused ones are QUKEY_UNKNOWN_ADDR
+};
+#endif
+
+// Lookup data for a qukeys table stored in PROGMEM, generated at
+// compile time by `QUKEYS_PROGMEM()`. `first` holds the index of the
+// first qukey on each key, and `next` the index of the next qukey on the
+// same key as each entry, so the table doesn't need to be sorted. It
+// costs TOTAL_KEYS + N bytes of flash, and no SRAM.
+template<uint8_t N>
+struct QukeyIndex {
+  int8_t first[TOTAL_KEYS];
+  int8_t next[N];
 };
 
-// Data structure for an entry in the key_queue
-struct QueueItem {
-  uint8_t addr;        // keyswitch coordinates
-  uint16_t start_time; // time a queued key was pressed
+namespace qukey_index {
+template<uint16_t... Is> struct Sequence {};
+// 0 to N - 1, built from two halves, so the template nesting depth is
+// log2(N), not N (TOTAL_KEYS can be over a thousand with 16-bit addrs)
+template<typename Lower, typename Upper> struct Concat;
+template<uint16_t... Lower, uint16_t... Upper>
+struct Concat<Sequence<Lower...>, Sequence<Upper...>> {
+  typedef Sequence < Lower..., (sizeof...(Lower) + Upper)... > type;
 };
+template<uint16_t N>
+struct MakeSequence {
+  typedef typename Concat < typename MakeSequence < N / 2 >::type,
+          typename MakeSequence < N - N / 2 >::type >::type type;
+};
+template<>
+struct MakeSequence<0> {
+  typedef Sequence<> type;
+};
+template<>
+struct MakeSequence<1> {
+  typedef Sequence<0> type;
+};
+
+// Index of the first qukey on `key_addr`, starting from entry `i`
+template<uint8_t N>
+constexpr int8_t find(const Qukey (&table)[N], addr::KeyAddr key_addr, uint8_t i) {
+  return ((i == N) ? QUKEY_NOT_FOUND :
+          (table[i].addr == key_addr) ? i :
+          find(table, key_addr, i + 1));
+}
+
+template<uint8_t N, uint16_t... Addrs, uint16_t... Is>
+constexpr QukeyIndex<N> make(const Qukey (&table)[N], Sequence<Addrs...>, Sequence<Is...>) {
+  return QukeyIndex<N> {
+    { find(table, Addrs, 0)... },
+    { find(table, table[Is].addr, Is + 1)... }
+  };
+}
+} // namespace qukey_index {
+
+template<uint8_t N>
+constexpr QukeyIndex<N> makeQukeyIndex(const Qukey (&table)[N]) {
+  return qukey_index::make(table,
+                           typename qukey_index::MakeSequence<TOTAL_KEYS>::type(),
+                           typename qukey_index::MakeSequence<N>::type());
+}
 
-// The plugin itself
-class Qukeys : public kaleidoscope::Plugin {
+#if QUKEYS_TRACE_SIZE
+// A record in the event trace. `flags` is either a keyswitch event
+// (QUKEYS_TRACE_PRESS set for a press, clear for a release), or, if
+// QUKEYS_TRACE_FLUSH is set, a key being flushed from the queue.
+// `delta` is the time in ms since the previous record (saturating).
+struct TraceRecord {
+  addr::KeyAddr addr;
+  uint8_t flags;
+  uint16_t delta;
+} __attribute__((packed));
+#define QUKEYS_TRACE_PRESS     0x01
+#define QUKEYS_TRACE_FLUSH     0x80
+// Flags for flush records
+#define QUKEYS_TRACE_ALTERNATE 0x01 // flushed in its alternate state
+#define QUKEYS_TRACE_HELD      0x02 // still held when flushed
+#define QUKEYS_TRACE_PLAIN     0x04 // not a qukey
+#endif
+
+#if QUKEYS_STATS
+// Statistics on how Qukeys made its decisions, for tuning time limits.
+// Counters stop at their maximum value instead of wrapping.
+template<uint8_t QueueMax>
+struct BasicQukeysStats {
+  // How qukeys' states were decided
+  uint16_t timeouts;       // alternate: held past the time limit
+  uint16_t later_releases; // alternate: a subsequent key was released first
+  uint16_t taps;           // primary: the qukey itself was released first
+  uint16_t release_delays; // primary: its release delay ran out
+  uint16_t overflows;      // forced out of a full queue (by the overflow policy)
+  uint16_t opposite_hand;  // alternate: a key on the other hand was pressed
+  uint16_t same_hand;      // primary: a key on the same hand was pressed
+  uint16_t quick_taps;     // primary: pressed again right after a tap
+  // Qukey presses that skipped the queue, and that were queued, while
+  // the streak bypass was on
+  uint16_t streak_bypassed;
+  uint16_t streak_queued;
+  // HID reports that weren't sent because of coalescing
+  uint16_t reports_saved;
+  // Number of times the queue grew to each length, 1 to QueueMax
+  uint16_t queue_depth[QueueMax];
+  // Time keys spent in the queue, in ms. Bucket 0 of the histogram
+  // counts 0ms, bucket n counts 2^(n-1) to 2^n - 1ms, and the last one
+  // everything longer. `flushed` and `latency_total` are both halved
+  // when `flushed` would overflow, instead of saturating.
+  uint16_t flushed;
+  uint16_t latency_min;
+  uint16_t latency_max;
+  uint32_t latency_total;
+  uint16_t latency[QUKEYS_LATENCY_BUCKETS];
+
+  uint16_t latencyAverage() const {
+    return flushed ? latency_total / flushed : 0;
+  }
+};
+typedef BasicQukeysStats<QUKEYS_QUEUE_MAX> QukeysStats;
+#endif
+
+#if QUKEYS_REPORT_LATENCY
+// Outcomes of key presses, each with its own report latency histogram
+#define QUKEYS_LATENCY_PRIMARY   0 // a qukey in its primary state
+#define QUKEYS_LATENCY_ALTERNATE 1 // a qukey in its alternate state
+#define QUKEYS_LATENCY_PLAIN     2 // any other key
+#define QUKEYS_LATENCY_OUTCOMES  3
+
+// Time from key presses to the first HID reports they showed up in, in
+// ms. Bucket n counts n * QUKEYS_REPORT_LATENCY_BUCKET_MS up to the
+// next bucket, and the last one everything longer. Counters stop at
+// their maximum value instead of wrapping.
+struct LatencyHistogram {
+  uint16_t count;
+  uint16_t max;
+  uint16_t buckets[QUKEYS_REPORT_LATENCY_BUCKETS];
+
+  // Latency that `percent`% of the presses didn't exceed, rounded up to
+  // the end of its bucket (but no more than `max`)
+  uint16_t percentile(uint8_t percent) const;
+};
+
+// A press in a report that hasn't been sent yet
+struct LatencySample {
+  uint16_t press_time; // (truncated)
+  uint8_t outcome;
+};
+#endif
+
+#if QUKEYS_PROFILE
+// Number of calls of a function, and the time spent in them (including
+// any functions they call)
+struct ProfileTiming {
+  uint32_t calls;
+  uint32_t total_us;
+};
+
+struct QukeysProfile {
+  ProfileTiming flush_key;
+  ProfileTiming lookup_qukey;
+};
+#endif
+
+// The plugin itself, for the first `Rows` rows of the keyboard (of
+// `Cols` keys each), with a queue of up to `QueueMax` keys and `Timer`
+// deadlines. Its state is all static, so each instantiation has its own,
+// sized for it: index types, arrays and searches of the queue depend only
+// on these. `Qukeys` below is the one for the whole keyboard, with
+// QUKEYS_QUEUE_MAX and QUKEYS_TIMER_TYPE; it's the one Qukeys.cpp
+// instantiates.
+template<uint8_t Rows, uint8_t Cols, uint8_t QueueMax, typename Timer>
+class BasicQukeys : public kaleidoscope::Plugin {
   // I could use a bitfield to get the state values, but then we'd
   // have to check the key_queue (there are three states). Or use a
   // second bitfield for the indeterminite state. Using a bitfield
   // would enable storing the qukey list in PROGMEM, but I don't know
   // if the added complexity is worth it.
+  // Keys are numbered by addr::addr(), with the keyboard's COLS
+  static_assert(Cols == COLS && Rows <= ROWS, "Qukeys can't have more keys than the keyboard");
+  static_assert(QueueMax > 0 && QueueMax <= 127, "the queue length must fit in an int8_t");
+  static constexpr uint16_t total_keys_ = Rows * Cols;
+
  public:
-  Qukeys(void);
+  BasicQukeys(void);
 
   static void activate(void) {
     active_ = true;
@@ -93,13 +443,140 @@ class Qukeys : public kaleidoscope::Plugin {
   static void setTimeout(uint16_t time_limit) {
     time_limit_ = time_limit;
   }
+  static uint16_t getTimeout(void) {
+    return time_limit_;
+  }
   static void setReleaseDelay(uint8_t release_delay) {
     release_delay_ = release_delay;
   }
+  static uint8_t getReleaseDelay(void) {
+    return release_delay_;
+  }
+  // Time limits for DualUse keys in the keymap, by type (`MT()` and
+  // `LT()`); zero means the global time limit is used
+  static void setDualUseModifierTimeout(uint16_t time_limit) {
+    dum_time_limit_ = time_limit;
+  }
+  static void setDualUseLayerTimeout(uint16_t time_limit) {
+    dul_time_limit_ = time_limit;
+  }
+#if QUKEYS_ADAPTIVE
+  // Adapt the time limit of qukeys to the user's typing: when a qukey
+  // is pressed during a typing streak (less than `streak_interval` ms
+  // after the previous keypress), its time limit is twice its recent
+  // average tap duration, kept within the given bounds. A maximum of
+  // zero turns it off (the default).
+  static void setAdaptiveTimeout(uint16_t min_time_limit, uint16_t max_time_limit,
+                                 uint16_t streak_interval = 200);
+#endif
+#if QUKEYS_QUICK_TAP
+  // A qukey that's pressed again less than `window` ms after it was
+  // tapped gets its primary keycode right away, so it can be held to
+  // repeat it (unless other keys are queued already). Zero turns it off
+  // (the default).
+  static void setQuickTapWindow(uint16_t window) {
+    quick_tap_window_ = window;
+  }
+#endif
+  // QUKEYS_OVERFLOW_ALTERNATE (the default) or QUKEYS_OVERFLOW_PRIMARY
+  static void setOverflowPolicy(uint8_t policy) {
+    overflow_policy_ = policy;
+  }
+#if QUKEYS_STREAK_BYPASS
+  // A qukey pressed less than `interval` ms after the last press of a
+  // key that isn't a qukey gets its primary keycode right away, without
+  // being queued (unless other keys are queued already). Zero turns it
+  // off (the default).
+  static void setStreakBypass(uint16_t interval) {
+    streak_interval_ = interval;
+  }
+#endif
+  // With a hand map (see `QUKEYS_HANDS()`), pressing a key on the other
+  // hand from a pending qukey decides it in its alternate state right
+  // away. `nullptr` turns it off (the default).
+  static void setHands(const uint8_t *hands) {
+    hands_ = hands;
+  }
+  // QUKEYS_SAME_HAND_WAIT (the default) or QUKEYS_SAME_HAND_PRIMARY
+  static void setSameHandPolicy(uint8_t policy) {
+    same_hand_policy_ = policy;
+  }
+
+#if QUKEYS_TRACE_SIZE
+  // Write the trace buffer to the serial port, oldest record first: a
+  // header of 'Q', 'T', format version (2), Rows, Cols, the size of an
+  // addr (1 or 2 bytes) and the number of records, followed by the
+  // records themselves (packed, little-endian). Use
+  // `tools/decode-qukeys-trace` to turn it back into a key timeline.
+  static void dumpTrace(void);
+  static void clearTrace(void) {
+    trace_length_ = 0;
+  }
+#endif
+
+#if QUKEYS_STATS
+  static const BasicQukeysStats<QueueMax> &stats(void) {
+    return stats_;
+  }
+  static void resetStats(void);
+#endif
+
+#if QUKEYS_PROFILE
+  static const QukeysProfile &profile(void) {
+    return profile_;
+  }
+  static void resetProfile(void) {
+    memset(&profile_, 0, sizeof(profile_));
+  }
+#endif
+
+#if QUKEYS_REPORT_LATENCY
+  // Report latency histogram for one outcome (QUKEYS_LATENCY_PRIMARY,
+  // QUKEYS_LATENCY_ALTERNATE or QUKEYS_LATENCY_PLAIN)
+  static const LatencyHistogram &reportLatency(uint8_t outcome) {
+    return report_latency_[outcome];
+  }
+  static void resetReportLatency(void);
+  // Write the histograms to the serial port as CSV, one line per
+  // outcome: count, maximum, 50th/90th/99th percentiles, and buckets
+  static void printReportLatency(void);
+#endif
+  // When several keys are flushed from the queue at once, send as few
+  // HID reports as possible, without changing what the host sees
+  static void setReportCoalescing(bool coalesce_reports) {
+    coalesce_reports_ = coalesce_reports;
+  }
 
   static Qukey * qukeys;
   static uint8_t qukeys_count;
 
+#if QUKEYS_CHORDS_MAX
+  // Use a table of chords; see `CHORDS()`
+  static void setChords(const Chord *chords, uint8_t count);
+#endif
+
+#if !QUKEYS_PROGMEM_ONLY
+  // Sort the qukeys table by key address and rebuild the per-address
+  // index. This gets called by `QUKEYS()` and `onSetup()`, and must be
+  // called again if the table is modified afterwards.
+  static void indexQukeys(void);
+  // Replace entry `i` of the (indexed) qukeys table, moving it to keep
+  // the table sorted, and updating only the parts of the index that
+  // changed. A qukey for one layer is put ahead of the same key's qukey
+  // for all layers. An entry with QUKEY_UNKNOWN_ADDR is unused.
+  static void setQukey(uint8_t i, const Qukey &qukey);
+#endif
+
+  // Use a qukeys table stored in PROGMEM, along with its precomputed
+  // index; see `QUKEYS_PROGMEM()`
+  template<uint8_t N>
+  static void useProgmemQukeys(const Qukey (&table)[N], const QukeyIndex<N> &index) {
+    progmem_qukeys_ = table;
+    progmem_qukey_first_ = index.first;
+    progmem_qukey_next_ = index.next;
+    qukeys_count = N;
+  }
+
   EventHandlerResult onSetup();
   EventHandlerResult onKeyswitchEvent(Key &mapped_key, byte row, byte col, uint8_t key_state);
   EventHandlerResult beforeReportingState();
@@ -114,35 +591,409 @@ class Qukeys : public kaleidoscope::Plugin {
   static bool active_;
   static uint16_t time_limit_;
   static uint8_t release_delay_;
-  static QueueItem key_queue_[QUKEYS_QUEUE_MAX];
+  static uint16_t dum_time_limit_;
+  static uint16_t dul_time_limit_;
+
+#if QUKEYS_ADAPTIVE
+  // Adaptive time limit state: the time of the last keypress, and tap
+  // statistics for the most recently used qukeys (4 bytes each; 43
+  // bytes in total with the default of 8 slots)
+  struct TapStats {
+    addr::KeyAddr addr;
+    uint8_t tap_time;    // average tap duration (ms); zero if unknown
+    uint16_t press_time; // time of the last press (truncated)
+  };
+  static uint16_t adaptive_min_;
+  static uint16_t adaptive_max_;
+  static uint16_t adaptive_streak_interval_;
+  static uint32_t last_press_time_;
+  static TapStats tap_stats_[QUKEYS_TAP_STATS_SLOTS];
+  static uint8_t tap_stats_next_;
+#endif
+
+#if QUKEYS_QUICK_TAP
+  // Release times of the most recently tapped qukeys (3 bytes each)
+  struct QuickTap {
+    addr::KeyAddr addr;
+    uint16_t tap_time; // time of the release (truncated)
+  };
+  static uint16_t quick_tap_window_;
+  static QuickTap quick_taps_[QUKEYS_QUICK_TAP_SLOTS];
+  static uint8_t quick_taps_next_;
+  static void recordQuickTap(addr::KeyAddr key_addr);
+  static bool isQuickTap(addr::KeyAddr key_addr);
+#endif
+
+  static uint8_t overflow_policy_;
+
+#if QUKEYS_STREAK_BYPASS
+  // Typing streak bypass
+  static uint16_t streak_interval_;
+  static uint32_t last_plain_press_time_;
+#endif
+
+#if QUKEYS_CHORDS_MAX
+  // The chords table, and for each key, a bitmask of the chords it's
+  // part of. While a chord is pending, its keys are the last
+  // `chord_length_` entries of the queue, and `chord_candidates_` has
+  // the chords they could still complete. Once one is complete, the key
+  // that completed it (`chord_addr_`) produces its keycode.
+  static const Chord *chords_;
+  static uint8_t chords_count_;
+  static uint8_t chord_masks_[total_keys_];
+  static_assert(QUKEYS_CHORDS_MAX <= 8, "QUKEYS_CHORDS_MAX must be 8 or less");
+  static uint8_t chord_candidates_;
+  static uint8_t chord_length_;
+  static Timer chord_start_;
+  static Timer chord_deadline_;
+  static addr::KeyAddr chord_addr_;
+  static Key chord_keycode_;
+  static uint8_t pressChordKey(addr::KeyAddr key_addr);
+  static void matchChord(uint8_t chord, addr::KeyAddr key_addr);
+  static void cancelChord(void);
+  static uint8_t chordSize(uint8_t chord) {
+    uint8_t size = 0;
+    while (size < 4 && chords_[chord].keys[size] != QUKEY_UNKNOWN_ADDR)
+      size++;
+    return size;
+  }
+#endif
+
+  // Hand map (in PROGMEM, one byte per key), and what to do on a
+  // same-hand key press
+  static const uint8_t *hands_;
+  static uint8_t same_hand_policy_;
+  static uint8_t keyHand(addr::KeyAddr key_addr) {
+    return pgm_read_byte(&hands_[key_addr]);
+  }
+  static void decideByHand(addr::KeyAddr key_addr);
+  static EventHandlerResult skipQueue(addr::KeyAddr key_addr, Key &mapped_key);
+
+#if QUKEYS_TRACE_SIZE
+  // The ring buffer is indexed (and its length dumped) as a single byte
+  static_assert(QUKEYS_TRACE_SIZE <= 255, "QUKEYS_TRACE_SIZE can't be more than 255");
+  static TraceRecord trace_[QUKEYS_TRACE_SIZE];
+  static uint8_t trace_next_;
+  static uint8_t trace_length_;
+  static uint32_t trace_time_;
+  static void recordTrace(addr::KeyAddr key_addr, uint8_t flags);
+#endif
+
+#if QUKEYS_STATS || QUKEYS_REPORT_LATENCY
+  static void countStat(uint16_t &counter) {
+    if (counter != 0xFFFF)
+      counter++;
+  }
+#endif
+#if QUKEYS_STATS
+  static BasicQukeysStats<QueueMax> stats_;
+  static void recordLatency(uint16_t latency);
+#endif
+#if QUKEYS_PROFILE
+  static QukeysProfile profile_;
+#endif
+#if QUKEYS_REPORT_LATENCY
+  static LatencyHistogram report_latency_[QUKEYS_LATENCY_OUTCOMES];
+  // Keys in the flush report, waiting for it to be sent
+  static LatencySample latency_flushed_[QueueMax];
+  static uint8_t latency_flushed_count_;
+  // Keys that didn't go through the queue, so they're in the report at
+  // the end of this scan cycle, by outcome; and when the first one was
+  // pressed
+  static uint8_t latency_passed_[QUKEYS_LATENCY_OUTCOMES];
+  static uint16_t latency_passed_time_;
+  static void recordReportLatency(uint16_t latency, uint8_t outcome);
+  static void flushedLatency(uint16_t press_time, uint8_t outcome);
+  static void recordFlushedLatency(void);
+  static void passLatency(uint8_t outcome);
+  static void recordPassedLatency(void);
+#endif
+  // Data structure for an entry in the key_queue (12 bytes with a 32-bit
+  // timer, 10 with a 16-bit one; 1 more with 16-bit addrs or chords, and 2
+  // more with QUKEYS_STATS or QUKEYS_REPORT_LATENCY)
+  // The keycodes and classification of a queued key are resolved when it's
+  // queued, so flushing it doesn't need any keymap lookups, and a layer
+  // change from outside the queue can't remap it. They're only looked up
+  // again if a key flushed ahead of it changes the active layers.
+  struct QueueItem {
+    addr::KeyAddr addr;    // keyswitch coordinates
+    uint8_t state;         // QUEUE_ITEM_PENDING, QUEUE_ITEM_RELEASE_DELAYED or QUEUE_ITEM_TAPPED
+    bool is_qukey;         // true for qukeys and DualUse keys
+    uint8_t release_delay; // release delay to apply if the key is tapped (qukeys only)
+    Timer deadline;        // time at which the key gets flushed, if nothing else happens
+    Key primary_keycode;
+    Key alternate_keycode; // same as primary_keycode for keys that aren't qukeys
+#if QUKEYS_CHORDS_MAX
+    bool is_chord;         // true for the key that completed a chord (never looked up again)
+#endif
+#if QUKEYS_STATS || QUKEYS_REPORT_LATENCY
+    uint16_t start_time; // time the key was queued (truncated)
+#endif
+  };
+
+  // The key_queue is a circular buffer; key_queue_head_ is the slot
+  // of the oldest entry, so flushing a key doesn't shift the others
+  static QueueItem key_queue_[QueueMax];
+  static uint8_t key_queue_head_;
   static uint8_t key_queue_length_;
+  // Return the entry `index` places behind the head of the queue
+  static QueueItem &queueItem(uint8_t index) {
+    index += key_queue_head_;
+    if (index >= QueueMax)
+      index -= QueueMax;
+    return key_queue_[index];
+  }
+  static QueueItem &queueHead(void) {
+    return key_queue_[key_queue_head_];
+  }
   static bool flushing_queue_;
 
+  // Per-address index into the (sorted) qukeys table. Each entry holds
+  // the index of the first qukey defined for that key, or
+  // QUKEY_NOT_FOUND. Entries for the same key are contiguous, so a
+  // lookup only has to check the qukeys defined on that one key
+  // (usually just one), regardless of the size of the table. This costs
+  // one byte of SRAM per key (TOTAL_KEYS bytes; 64 on the Model01),
+  // unless QUKEYS_PROGMEM_ONLY is set.
+#if !QUKEYS_PROGMEM_ONLY
+  static int8_t qukey_index_[total_keys_];
+#endif
+
+  // The PROGMEM table and its index, if one is in use (instead of
+  // `qukeys` and qukey_index_)
+  static const Qukey * progmem_qukeys_;
+  static const int8_t * progmem_qukey_first_;
+  static const int8_t * progmem_qukey_next_;
+
+  // Accessors for qukeys table entries, wherever the table is stored
+  static int8_t firstQukey(addr::KeyAddr key_addr) {
+    if (progmem_qukeys_ != nullptr)
+      return pgm_read_byte(&progmem_qukey_first_[key_addr]);
+#if QUKEYS_PROGMEM_ONLY
+    return QUKEY_NOT_FOUND;
+#else
+    return qukey_index_[key_addr];
+#endif
+  }
+  static int8_t nextQukey(int8_t i) {
+    if (progmem_qukeys_ != nullptr)
+      return pgm_read_byte(&progmem_qukey_next_[i]);
+    if (i + 1 < qukeys_count && qukeys[i + 1].addr == qukeys[i].addr)
+      return i + 1;
+    return QUKEY_NOT_FOUND;
+  }
+  static int8_t qukeyLayer(int8_t i) {
+    if (progmem_qukeys_ != nullptr)
+      return pgm_read_byte(&progmem_qukeys_[i].layer);
+    return qukeys[i].layer;
+  }
+  static Key qukeyAltKeycode(int8_t i) {
+    if (progmem_qukeys_ != nullptr) {
+      Key keycode;
+      keycode.raw = pgm_read_word(&progmem_qukeys_[i].alt_keycode.raw);
+      return keycode;
+    }
+    return qukeys[i].alt_keycode;
+  }
+  static uint16_t qukeyTimeLimit(int8_t i) {
+    if (progmem_qukeys_ != nullptr)
+      return pgm_read_word(&progmem_qukeys_[i].time_limit);
+    return qukeys[i].time_limit;
+  }
+  static uint8_t qukeyReleaseDelay(int8_t i) {
+    if (progmem_qukeys_ != nullptr)
+      return pgm_read_byte(&progmem_qukeys_[i].release_delay);
+    return qukeys[i].release_delay;
+  }
+#if QUKEYS_TAP_DANCE
+  // Keycode for `taps` (2 or 3) taps of qukey `i`
+  static Key qukeyTapKeycode(int8_t i, uint8_t taps) {
+    if (progmem_qukeys_ != nullptr) {
+      Key keycode;
+      keycode.raw = pgm_read_word(&progmem_qukeys_[i].tap_keycodes[taps - 2].raw);
+      return keycode;
+    }
+    return qukeys[i].tap_keycodes[taps - 2];
+  }
+  // Number of taps in a row qukey `i` can take; 1 if it isn't a
+  // tap-dance qukey. A triple tap keycode without a double tap one is
+  // ignored: the dance can't skip a step.
+  static uint8_t qukeyMaxTaps(int8_t i) {
+    if (qukeyTapKeycode(i, 2).raw == Key_NoKey.raw)
+      return 1;
+    if (qukeyTapKeycode(i, 3).raw == Key_NoKey.raw)
+      return 2;
+    return 3;
+  }
+#endif
+  // Tap-dance qukeys always go through the queue, to count their taps
+  static bool isTapDance(int8_t qukey_index) {
+#if QUKEYS_TAP_DANCE
+    return qukey_index != QUKEY_NOT_FOUND && qukeyMaxTaps(qukey_index) > 1;
+#else
+    (void)qukey_index;
+    return false;
+#endif
+  }
+
+  // While keys are being flushed from the queue, Keyboard.keyReport is
+  // the flush report: it starts out as the last report sent, and each
+  // flushed key is added to it in turn. The report the scan was building
+  // is parked in scan_report_ until the end of the sequence, and the
+  // keys that are still held get added back to it then.
+  static bool flush_report_active_;
+  static HID_KeyboardReport_Data_t scan_report_;
+  static Key held_keycodes_[QueueMax];
+  static addr::KeyAddr held_addrs_[QueueMax];
+  static uint8_t held_count_;
+  // Report coalescing state: flush_report_pending_ is set when the flush
+  // report has changes that haven't been sent to the host yet
+  static bool coalesce_reports_;
+  static bool flush_report_pending_;
+
   // Qukey state bitfield
-  static uint8_t qukey_state_[(TOTAL_KEYS) / 8 + ((TOTAL_KEYS) % 8 ? 1 : 0)];
-  static bool getQukeyState(uint8_t addr) {
+  static uint8_t qukey_state_[total_keys_ / 8 + (total_keys_ % 8 ? 1 : 0)];
+  static bool getQukeyState(addr::KeyAddr addr) {
     return bitRead(qukey_state_[addr / 8], addr % 8);
   }
-  static void setQukeyState(uint8_t addr, boolean qukey_state) {
+  static void setQukeyState(addr::KeyAddr addr, boolean qukey_state) {
     bitWrite(qukey_state_[addr / 8], addr % 8, qukey_state);
   }
 
-  static int8_t lookupQukey(uint8_t key_addr);
-  static void enqueue(uint8_t key_addr);
-  static int8_t searchQueue(uint8_t key_addr);
+#if QUKEYS_TAP_DANCE
+  // Tap-dance state: the number of times each tap-dance qukey has been
+  // pressed in a row (0 to 3), two bits per key. Once it's been pressed
+  // more than once, a qukey in its alternate state produces the keycode
+  // for that many taps.
+  static uint8_t tap_counts_[total_keys_ / 4 + (total_keys_ % 4 ? 1 : 0)];
+  static uint8_t tapCount(addr::KeyAddr addr) {
+    return (tap_counts_[addr / 4] >> (2 * (addr % 4))) & 0x03;
+  }
+  static void setTapCount(addr::KeyAddr addr, uint8_t taps) {
+    uint8_t shift = 2 * (addr % 4);
+    tap_counts_[addr / 4] = (tap_counts_[addr / 4] & ~(0x03 << shift)) | (taps << shift);
+  }
+  static void continueTapDance(Key mapped_key, int8_t qukey_index);
+  static void finishTapDance(void);
+#endif
+  // Keycode of a qukey that's been flushed in its alternate state
+#if QUKEYS_TAP_DANCE
+  static Key heldAltKeycode(addr::KeyAddr key_addr, int8_t qukey_index) {
+    uint8_t taps = tapCount(key_addr);
+    if (taps > 1)
+      return qukeyTapKeycode(qukey_index, taps);
+    return qukeyAltKeycode(qukey_index);
+  }
+#else
+  static Key heldAltKeycode(addr::KeyAddr, int8_t qukey_index) {
+    return qukeyAltKeycode(qukey_index);
+  }
+#endif
+
+  static int8_t lookupQukey(addr::KeyAddr key_addr);
+#if !QUKEYS_PROGMEM_ONLY
+  static void indexQukey(addr::KeyAddr key_addr);
+#endif
+  static uint16_t timeLimit(int8_t qukey_index, Key key);
+  static uint8_t releaseDelay(int8_t qukey_index);
+#if QUKEYS_ADAPTIVE
+  static int8_t findTapStats(addr::KeyAddr key_addr);
+  static uint16_t adaptTimeLimit(addr::KeyAddr key_addr, bool is_qukey, uint16_t time_limit);
+  static void recordTap(addr::KeyAddr key_addr);
+#endif
+  static void enqueue(addr::KeyAddr key_addr, Key mapped_key, int8_t qukey_index,
+                      uint16_t time_limit);
+  static void resolveKeys(QueueItem &item, Key mapped_key, int8_t qukey_index);
+  static void resolveQueue();
+  // Position of a key in the queue, or QUKEY_NOT_FOUND. A short queue
+  // (8 keys or less) is searched with one comparison per slot, unrolled
+  // at compile time, instead of a loop.
+  static int8_t searchQueue(addr::KeyAddr key_addr) {
+    return searchQueueFrom(key_addr, QueuePosition<0>());
+  }
+  static constexpr uint8_t unrolled_queue_ = (QueueMax <= 8) ? QueueMax : 0;
+  template<uint8_t I> struct QueuePosition {};
+  template<uint8_t I>
+  static int8_t searchQueueFrom(addr::KeyAddr key_addr, QueuePosition<I>) {
+    if (I >= key_queue_length_)
+      return QUKEY_NOT_FOUND;
+    if (queueItem(I).addr == key_addr)
+      return I;
+    return searchQueueFrom(key_addr, QueuePosition<I + 1>());
+  }
+  // The rest of the queue, if it isn't unrolled (this overload is the
+  // better match, so the recursion stops here)
+  static int8_t searchQueueFrom(addr::KeyAddr key_addr, QueuePosition<unrolled_queue_>) {
+    for (int8_t i = unrolled_queue_; i < key_queue_length_; i++) {
+      if (queueItem(i).addr == key_addr)
+        return i;
+    }
+    return QUKEY_NOT_FOUND;
+  }
   static bool flushKey(bool qukey_state, uint8_t keyswitch_state);
   static void flushQueue(int8_t index);
   static void flushQueue(void);
-  static bool isQukey(uint8_t addr);
+  static void beginFlushReport(void);
+  static void addToFlushReport(uint8_t modifiers);
+  static void sendFlushReport(void);
 };
 
+// Qukeys for the whole keyboard
+typedef BasicQukeys<ROWS, COLS, QUKEYS_QUEUE_MAX, QUKEYS_TIMER_TYPE> Qukeys;
+
 } // namespace kaleidoscope {
 
 extern kaleidoscope::Qukeys Qukeys;
 
+// Largest table `QUKEYS()` accepts (qukeys are indexed with an int8_t).
+// QukeysConfig lowers it to the size of its table, which the sketch's
+// table is copied into.
+#define QUKEYS_TABLE_MAX 127
+
 // macro for use in sketch file to simplify definition of qukeys
+#if QUKEYS_PROGMEM_ONLY
+#define QUKEYS(qukey_defs...)						\
+  static_assert(false, "QUKEYS() needs QUKEYS_PROGMEM_ONLY to be 0");
+#else
 #define QUKEYS(qukey_defs...) {						\
   static kaleidoscope::Qukey qk_table[] = { qukey_defs };		\
+  static_assert(sizeof(qk_table) / sizeof(kaleidoscope::Qukey) <= QUKEYS_TABLE_MAX, \
+                "Too many qukeys (for QukeysConfig, increase QUKEYS_CONFIG_MAX)"); \
   Qukeys.qukeys = qk_table;						\
   Qukeys.qukeys_count = sizeof(qk_table) / sizeof(kaleidoscope::Qukey); \
+  Qukeys.indexQukeys();							\
+}
+#endif
+
+// Define the chords (with `kaleidoscope::Chord(keycode, time_limit,
+// row1, col1, row2, col2, ...)`); needs QUKEYS_CHORDS_MAX to be at
+// least the number of chords
+#define CHORDS(chord_defs...) {						\
+  static const kaleidoscope::Chord qk_chords[] = { chord_defs };	\
+  static_assert(sizeof(qk_chords) / sizeof(kaleidoscope::Chord) <= QUKEYS_CHORDS_MAX, \
+                "Too many chords; increase QUKEYS_CHORDS_MAX");	\
+  Qukeys.setChords(qk_chords, sizeof(qk_chords) / sizeof(kaleidoscope::Chord)); \
+}
+
+// Define which hand each key is on, in PROGMEM, with one entry
+// (QUKEY_HAND_LEFT, QUKEY_HAND_RIGHT or QUKEY_HAND_NONE) per key, in
+// order of row, then column
+#define QUKEYS_HANDS(hand_defs...) {					\
+  static const uint8_t qk_hands[] PROGMEM = { hand_defs };		\
+  static_assert(sizeof(qk_hands) == TOTAL_KEYS,				\
+                "QUKEYS_HANDS() needs exactly one entry per key");	\
+  Qukeys.setHands(qk_hands);						\
+}
+
+// Like `QUKEYS()`, but the table and its lookup index are generated at
+// compile time and stored in PROGMEM, so they need no initialization at
+// startup, and take no SRAM (but the index `QUKEYS()` would use is still
+// allocated, unless QUKEYS_PROGMEM_ONLY is set)
+#define QUKEYS_PROGMEM(qukey_defs...) {					\
+  static constexpr kaleidoscope::Qukey qk_table[] PROGMEM = { qukey_defs }; \
+  static_assert(sizeof(qk_table) / sizeof(kaleidoscope::Qukey) <= 127,	\
+                "Too many qukeys (they're indexed with an int8_t)");	\
+  static constexpr auto qk_index PROGMEM =				\
+    kaleidoscope::makeQukeyIndex(qk_table);				\
+  Qukeys.useProgmemQukeys(qk_table, qk_index);				\
 }
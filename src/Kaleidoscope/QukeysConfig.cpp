@@ -0,0 +1,235 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys-Config.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
+#include <EEPROM.h>
+
+namespace kaleidoscope {
+
+inline
+uint16_t readWord(uint16_t pos) {
+  return EEPROM.read(pos) | (EEPROM.read(pos + 1) << 8);
+}
+
+inline
+void updateWord(uint16_t pos, uint16_t value) {
+  EEPROM.update(pos, value & 0xFF);
+  EEPROM.update(pos + 1, value >> 8);
+}
+
+uint16_t QukeysConfig::settings_base_;
+Qukey QukeysConfig::table_[QUKEYS_CONFIG_MAX];
+
+EventHandlerResult QukeysConfig::onSetup() {
+  settings_base_ = ::EEPROMSettings.requestSlice(header_size_ +
+                                                 QUKEYS_CONFIG_MAX * entry_size_);
+  load();
+  return EventHandlerResult::OK;
+}
+
+// Copy the table from EEPROM, and make it the one `Qukeys` uses. If
+// nothing has been saved yet, or EEPROMSettings found the EEPROM's
+// contents invalid (e.g. after the slices' layout changed), it starts as
+// a copy of the sketch's table (one defined with `QUKEYS()`; a PROGMEM
+// table can't be copied).
+// Unused entries have QUKEY_UNKNOWN_ADDR, so they're sorted to the end
+// of the table, and never found by a lookup.
+void QukeysConfig::load() {
+  bool saved = (::EEPROMSettings.isValid() &&
+                EEPROM.read(settings_base_) == QUKEYS_CONFIG_VERSION);
+  if (saved) {
+    ::Qukeys.setTimeout(readWord(settings_base_ + 1));
+    ::Qukeys.setReleaseDelay(EEPROM.read(settings_base_ + 3));
+  }
+  uint16_t pos = settings_base_ + header_size_;
+  for (uint8_t i = 0; i < QUKEYS_CONFIG_MAX; i++, pos += entry_size_) {
+    if (saved) {
+      table_[i] = readQukey(pos);
+    } else if (::Qukeys.qukeys != nullptr && i < ::Qukeys.qukeys_count) {
+      table_[i] = ::Qukeys.qukeys[i];
+    } else {
+      table_[i] = Qukey(0, 0, 0, Key_NoKey);
+      table_[i].addr = QUKEY_UNKNOWN_ADDR;
+    }
+  }
+  ::Qukeys.qukeys = table_;
+  ::Qukeys.qukeys_count = QUKEYS_CONFIG_MAX;
+  ::Qukeys.indexQukeys();
+}
+
+// Write the settings and the whole table; only the bytes that changed
+// actually get written
+void QukeysConfig::save() {
+  EEPROM.update(settings_base_, QUKEYS_CONFIG_VERSION);
+  updateWord(settings_base_ + 1, ::Qukeys.getTimeout());
+  EEPROM.update(settings_base_ + 3, ::Qukeys.getReleaseDelay());
+  uint16_t pos = settings_base_ + header_size_;
+  for (uint8_t i = 0; i < QUKEYS_CONFIG_MAX; i++, pos += entry_size_)
+    writeQukey(pos, table_[i]);
+}
+
+Qukey QukeysConfig::readQukey(uint16_t pos) {
+  Qukey qukey;
+  qukey.layer = EEPROM.read(pos++);
+  qukey.addr = 0;
+  for (uint8_t i = 0; i < sizeof(addr::KeyAddr); i++)
+    qukey.addr |= addr::KeyAddr(EEPROM.read(pos++)) << (8 * i);
+  qukey.alt_keycode.raw = readWord(pos);
+  qukey.time_limit = readWord(pos + 2);
+  qukey.release_delay = EEPROM.read(pos + 4);
+#if QUKEYS_TAP_DANCE
+  qukey.tap_keycodes[0].raw = readWord(pos + 5);
+  qukey.tap_keycodes[1].raw = readWord(pos + 7);
+#endif
+  return qukey;
+}
+
+void QukeysConfig::writeQukey(uint16_t pos, const Qukey &qukey) {
+  EEPROM.update(pos++, qukey.layer);
+  for (uint8_t i = 0; i < sizeof(addr::KeyAddr); i++)
+    EEPROM.update(pos++, (qukey.addr >> (8 * i)) & 0xFF);
+  updateWord(pos, qukey.alt_keycode.raw);
+  updateWord(pos + 2, qukey.time_limit);
+  EEPROM.update(pos + 4, qukey.release_delay);
+#if QUKEYS_TAP_DANCE
+  updateWord(pos + 5, qukey.tap_keycodes[0].raw);
+  updateWord(pos + 7, qukey.tap_keycodes[1].raw);
+#endif
+}
+
+// Find the entry for a key on a layer; with QUKEY_UNKNOWN_ADDR, this
+// finds an unused entry
+int8_t QukeysConfig::findQukey(int8_t layer, addr::KeyAddr key_addr) {
+  for (int8_t i = 0; i < QUKEYS_CONFIG_MAX; i++) {
+    if (table_[i].addr == key_addr &&
+        (table_[i].layer == layer || key_addr == QUKEY_UNKNOWN_ADDR))
+      return i;
+  }
+  return QUKEY_NOT_FOUND;
+}
+
+bool QukeysConfig::focusHook(const char *command) {
+  if (strncmp_P(command, PSTR("qukeys."), 7) != 0)
+    return false;
+  command += 7;
+
+  if (strcmp_P(command, PSTR("map")) == 0)
+    return focusMap();
+
+  if (strcmp_P(command, PSTR("timeout")) == 0) {
+    if (Serial.peek() == '\n') {
+      Serial.println(::Qukeys.getTimeout());
+    } else {
+      ::Qukeys.setTimeout(Serial.parseInt());
+      save();
+    }
+    return true;
+  }
+
+  if (strcmp_P(command, PSTR("releaseDelay")) == 0) {
+    if (Serial.peek() == '\n') {
+      Serial.println(::Qukeys.getReleaseDelay());
+    } else {
+      ::Qukeys.setReleaseDelay(Serial.parseInt());
+      save();
+    }
+    return true;
+  }
+
+  return false;
+}
+
+bool QukeysConfig::focusMap() {
+  if (Serial.peek() == '\n') {
+    for (uint8_t i = 0; i < QUKEYS_CONFIG_MAX; i++) {
+      const Qukey &qukey = table_[i];
+      if (qukey.addr == QUKEY_UNKNOWN_ADDR)
+        continue;
+      Serial.print(qukey.layer);
+      Serial.print(' ');
+      Serial.print(addr::row(qukey.addr));
+      Serial.print(' ');
+      Serial.print(addr::col(qukey.addr));
+      Serial.print(' ');
+      Serial.print(qukey.alt_keycode.raw);
+      Serial.print(' ');
+      Serial.print(qukey.time_limit);
+      Serial.print(' ');
+#if QUKEYS_TAP_DANCE
+      Serial.print(qukey.release_delay);
+      Serial.print(' ');
+      Serial.print(qukey.tap_keycodes[0].raw);
+      Serial.print(' ');
+      Serial.println(qukey.tap_keycodes[1].raw);
+#else
+      Serial.println(qukey.release_delay);
+#endif
+    }
+    return true;
+  }
+
+  int8_t layer = Serial.parseInt();
+  byte row = Serial.parseInt();
+  byte col = Serial.parseInt();
+  Key alt_keycode;
+  alt_keycode.raw = Serial.parseInt();
+  uint16_t time_limit = Serial.parseInt();
+  uint8_t release_delay = Serial.parseInt();
+#if QUKEYS_TAP_DANCE
+  Key double_tap_keycode, triple_tap_keycode;
+  double_tap_keycode.raw = Serial.parseInt();
+  triple_tap_keycode.raw = Serial.parseInt();
+  // A triple tap keycode needs a double tap one
+  if (double_tap_keycode.raw == Key_NoKey.raw &&
+      triple_tap_keycode.raw != Key_NoKey.raw)
+    return true;
+#endif
+  if (row >= ROWS || col >= COLS)
+    return true;
+
+  int8_t i = findQukey(layer, addr::addr(row, col));
+  if (alt_keycode.raw == Key_NoKey.raw) {
+    // Remove the qukey, if there is one
+    if (i == QUKEY_NOT_FOUND)
+      return true;
+    Qukey unused = Qukey(0, 0, 0, Key_NoKey);
+    unused.addr = QUKEY_UNKNOWN_ADDR;
+    ::Qukeys.setQukey(i, unused);
+  } else {
+    // Replace the qukey, or add it to an unused entry (if the table
+    // isn't full)
+    if (i == QUKEY_NOT_FOUND)
+      i = findQukey(0, QUKEY_UNKNOWN_ADDR);
+    if (i == QUKEY_NOT_FOUND)
+      return true;
+#if QUKEYS_TAP_DANCE
+    ::Qukeys.setQukey(i, Qukey(layer, row, col, alt_keycode, time_limit, release_delay,
+                               double_tap_keycode, triple_tap_keycode));
+#else
+    ::Qukeys.setQukey(i, Qukey(layer, row, col, alt_keycode, time_limit, release_delay));
+#endif
+  }
+  save();
+  return true;
+}
+
+} // namespace kaleidoscope {
+
+kaleidoscope::QukeysConfig QukeysConfig;
@@ -0,0 +1,98 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys.h>
+
+#if QUKEYS_PROGMEM_ONLY
+#error "QukeysConfig keeps the qukeys table in SRAM; it needs QUKEYS_PROGMEM_ONLY to be 0"
+#endif
+
+// Number of entries in the qukeys table stored in EEPROM
+#ifndef QUKEYS_CONFIG_MAX
+#define QUKEYS_CONFIG_MAX 16
+#endif
+// The table defined with `QUKEYS()` is copied into this one, so it can't
+// have more entries
+#undef QUKEYS_TABLE_MAX
+#define QUKEYS_TABLE_MAX QUKEYS_CONFIG_MAX
+
+// Format version of the EEPROM data; a blank EEPROM reads as 0xFF.
+// Tap-dance keycodes make the entries bigger, so the table is laid out
+// differently with them.
+#if QUKEYS_TAP_DANCE
+#define QUKEYS_CONFIG_VERSION 2
+#else
+#define QUKEYS_CONFIG_VERSION 1
+#endif
+
+namespace kaleidoscope {
+
+// Keeps the qukeys table and the global time limit and release delay in
+// EEPROM, so they can be changed over the serial port, with
+// Kaleidoscope-Focus, without reflashing. Until something is changed,
+// the table defined with `QUKEYS()` in the sketch is used.
+class QukeysConfig : public kaleidoscope::Plugin {
+ public:
+  QukeysConfig(void) {}
+
+  EventHandlerResult onSetup();
+
+  // Focus commands:
+  //   qukeys.map [layer row col alt_keycode [time_limit [release_delay]]]
+  //   qukeys.timeout [ms]
+  //   qukeys.releaseDelay [ms]
+  // Without arguments, they print the current settings (`qukeys.map`
+  // prints one qukey per line). `qukeys.map` replaces the qukey on the
+  // given layer and key, or removes it if `alt_keycode` is 0. With
+  // QUKEYS_TAP_DANCE, it also takes (and prints) the double and triple
+  // tap keycodes, after `release_delay`.
+  static bool focusHook(const char *command);
+
+ private:
+  // Size of one serialized qukey: layer, addr, alt_keycode, time_limit
+  // and release_delay (and the tap keycodes), with no padding
+  static constexpr uint8_t entry_size_ = 1 + sizeof(addr::KeyAddr) + 2 + 2 + 1
+#if QUKEYS_TAP_DANCE
+                                         + 2 + 2
+#endif
+                                         ;
+  // Header: version, time limit (2 bytes) and release delay
+  static constexpr uint8_t header_size_ = 4;
+
+  static uint16_t settings_base_;
+  static Qukey table_[QUKEYS_CONFIG_MAX];
+
+  static void load(void);
+  static void save(void);
+  static Qukey readQukey(uint16_t pos);
+  static void writeQukey(uint16_t pos, const Qukey &qukey);
+  static int8_t findQukey(int8_t layer, addr::KeyAddr key_addr);
+  static bool focusMap(void);
+};
+
+} // namespace kaleidoscope {
+
+extern kaleidoscope::QukeysConfig QukeysConfig;
+
+#define FOCUS_HOOK_QUKEYS FOCUS_HOOK(QukeysConfig.focusHook,	\
+                                     "qukeys.map\n"		\
+                                     "qukeys.timeout\n"		\
+                                     "qukeys.releaseDelay")
@@ -21,23 +21,33 @@
 #include <Kaleidoscope.h>
 
 // Helper functions for converting between separate (row,col)
-// coordinates and a single-byte key number (addr). This works as long
-// as the keyboard has fewer than 256 keys.
+// coordinates and a single key number (addr). Key numbers are one byte
+// if the keyboard has fewer than 256 keys (leaving 0xFF free as an
+// "unknown" value), and two bytes otherwise. The type can also be set
+// with QUKEYS_ADDR_TYPE.
 namespace kaleidoscope {
 namespace addr {
-inline uint8_t row(uint8_t key_addr) {
+#if defined(QUKEYS_ADDR_TYPE)
+typedef QUKEYS_ADDR_TYPE KeyAddr;
+#elif (ROWS * COLS) > 255
+typedef uint16_t KeyAddr;
+#else
+typedef uint8_t KeyAddr;
+#endif
+
+constexpr uint8_t row(KeyAddr key_addr) {
   return (key_addr / COLS);
 }
-inline uint8_t col(uint8_t key_addr) {
+constexpr uint8_t col(KeyAddr key_addr) {
   return (key_addr % COLS);
 }
-inline uint8_t addr(uint8_t row, uint8_t col) {
+constexpr KeyAddr addr(uint8_t row, uint8_t col) {
   return ((row * COLS) + col);
 }
-inline void mask(uint8_t key_addr) {
+inline void mask(KeyAddr key_addr) {
   KeyboardHardware.maskKey(row(key_addr), col(key_addr));
 }
-inline void unmask(uint8_t key_addr) {
+inline void unmask(KeyAddr key_addr) {
   KeyboardHardware.unMaskKey(row(key_addr), col(key_addr));
 }
 } // namespace addr {
@@ -0,0 +1,127 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Builds examples/QukeysBenchmark on the host and runs it, printing its
+// CSV. With QUKEYS_STATS (as `make test` builds it), it also checks that
+// the output is complete, and that each workload did what it claims to.
+// The timings are the host's, so they only mean anything compared with
+// each other, or with another version's on the same machine.
+
+#include "../examples/QukeysBenchmark/QukeysBenchmark.ino"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+namespace {
+
+int failures = 0;
+
+#if QUKEYS_STATS
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cout << "FAIL: " << what << "\n";
+    failures++;
+  }
+}
+
+// The CSV's lines, checked for the right number of fields and
+// consistent numbers
+void checkOutput(const std::string &output) {
+  std::istringstream lines(output);
+  std::string line;
+  std::getline(lines, line);
+  check(line == "workload,qukeys,cycles,total_us,ns_per_cycle"
+#if QUKEYS_PROFILE
+        ",flush_key_calls,flush_key_ns,lookup_qukey_calls,lookup_qukey_ns"
+#endif
+        , "header: " + line);
+  size_t rows = 0;
+  while (std::getline(lines, line)) {
+    rows++;
+    std::istringstream fields(line);
+    std::string workload;
+    char comma;
+    unsigned long qukeys, cycles, total_us, ns_per_cycle;
+    std::getline(fields, workload, ',');
+    fields >> qukeys >> comma >> cycles >> comma >> total_us >> comma >> ns_per_cycle;
+    check(!fields.fail() && cycles == bench::CYCLES &&
+          ns_per_cycle == total_us * 1000 / cycles, "row: " + line);
+#if QUKEYS_PROFILE
+    // Every workload but "idle" looks up its keys' qukeys. Keys are only
+    // queued (and flushed) with qukeys defined, and "rollover" and
+    // "full_queue" always queue keys behind one.
+    unsigned long flush_key_calls, flush_key_ns, lookup_qukey_calls, lookup_qukey_ns;
+    fields >> comma >> flush_key_calls >> comma >> flush_key_ns
+           >> comma >> lookup_qukey_calls >> comma >> lookup_qukey_ns;
+    check(!fields.fail() && fields.peek() == EOF, "row: " + line);
+    check((lookup_qukey_calls > 0) == (workload != "idle"), "lookupQukey() calls: " + line);
+    if (qukeys == 0 || workload == "idle")
+      check(flush_key_calls == 0, "flushKey() calls: " + line);
+    if (qukeys > 0 && (workload == "rollover" || workload == "full_queue"))
+      check(flush_key_calls > 0, "flushKey() calls: " + line);
+#endif
+  }
+  check(rows == sizeof(bench::WORKLOADS) / sizeof(*bench::WORKLOADS) *
+        sizeof(bench::TABLE_SIZES), "number of rows: " + std::to_string(rows));
+}
+#endif
+
+} // namespace {
+
+int main() {
+  host::reset();
+  host::setRealMicros(true);
+#if QUKEYS_STATS
+  Qukeys.resetStats();
+#endif
+
+  char *buffer = nullptr;
+  size_t size = 0;
+  FILE *output = open_memstream(&buffer, &size);
+  host::setSerialOutput(output);
+  setup();
+  // The benchmark starts 5s after startup; the clock only moves here,
+  // so Qukeys never sees any time pass while it runs
+  for (uint32_t time = 0; time <= 5001; time++) {
+    host::setTime(time);
+    loop();
+  }
+  host::setSerialOutput(stdout);
+  fclose(output);
+  std::string csv(buffer, size);
+  free(buffer);
+  std::cout << csv;
+
+#if QUKEYS_STATS
+  checkOutput(csv);
+  const kaleidoscope::QukeysStats &stats = Qukeys.stats();
+  // "full_queue" fills the queue, and every queued key is flushed by a
+  // release, not a timeout
+  check(stats.queue_depth[QUKEYS_QUEUE_MAX - 1] > 0, "the queue was never full");
+  check(stats.timeouts == 0, "keys timed out");
+  check(stats.later_releases > 0 && stats.taps > 0, "no qukeys were decided by a release");
+  check(stats.overflows == 0, "the queue overflowed");
+  std::cout << "bench: " << (failures ? "failed" : "passed") << "\n";
+#endif
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks QukeysConfig against the EEPROM stand-in: a blank EEPROM, Focus
+// commands changing the table, and "reboots" that load it back from the
+// file it's saved in.
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys.h>
+#include <Kaleidoscope-Qukeys-Config.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
+#include <EEPROM.h>
+
+#include <iostream>
+#include <string>
+
+#include "host.h"
+
+namespace {
+
+int checks = 0;
+int failures = 0;
+
+void check(const char *name, const std::string &value, const std::string &expected) {
+  checks++;
+  if (value != expected) {
+    std::cout << "FAIL: " << name << "\n"
+              << "  got:      " << value << "\n"
+              << "  expected: " << expected << "\n";
+    failures++;
+  }
+}
+
+// Start the keyboard with the EEPROM contents in `file`, as the sketch in
+// README.md does; `valid` is what EEPROMSettings says about them
+void boot(const char *file, bool valid = true) {
+  host::reset();
+  EEPROM.open(file);
+  EEPROMSettings = EEPROMSettings_();
+  if (!valid)
+    EEPROMSettings.invalidate();
+  QUKEYS(
+    kaleidoscope::Qukey(0, 2, 1, Key_LeftGui),
+    kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 2, 1, Key_LeftAlt),
+    kaleidoscope::Qukey(0, 2, 2, Key_LeftShift)
+  )
+  QukeysConfig.onSetup();
+  Kaleidoscope.setup();
+}
+
+// Run a Focus command, and return what it printed (with newlines
+// replaced by "|")
+std::string focus(const char *command, const std::string &args = "") {
+  char *buffer = nullptr;
+  size_t size = 0;
+  FILE *output = open_memstream(&buffer, &size);
+  host::setSerialInput(args + "\n");
+  host::setSerialOutput(output);
+  QukeysConfig.focusHook(command);
+  host::setSerialOutput(stdout);
+  fclose(output);
+  std::string result(buffer, size);
+  free(buffer);
+  for (auto &c : result) {
+    if (c == '\n')
+      c = '|';
+  }
+  return result;
+}
+
+// Hold a key past its time limit, and return the first report
+std::string hold(byte row, byte col) {
+  host::reports.clear();
+  uint32_t start = host::time();
+  host::setKeyswitch(row, col, true);
+  for (uint32_t time = start + 1; time < start + 500; time++) {
+    host::setTime(time);
+    Kaleidoscope.loop();
+  }
+  host::setKeyswitch(row, col, false);
+  for (uint32_t time = start + 500; time < start + 1000; time++) {
+    host::setTime(time);
+    Kaleidoscope.loop();
+  }
+  return host::reports.empty() ? "(no report)" : host::reportKeys(host::reports[0].data);
+}
+
+} // namespace {
+
+int main(int argc, char **argv) {
+  const char *file = argc > 1 ? argv[1] : "eeprom.bin";
+  remove(file);
+
+  boot(file);
+  check("blank EEPROM: the sketch's table", focus("qukeys.map"),
+        "0 2 1 227 0 0|-1 2 1 226 0 0|0 2 2 225 0 0|");
+  check("blank EEPROM: nothing written", std::to_string(EEPROM.writes()), "0");
+  check("blank EEPROM: layer 0 entry first", hold(2, 1), "LeftGui");
+
+  // Replacing a qukey keeps its precedence over the other one on the same key
+  focus("qukeys.map", "0 2 1 224 0 0");
+  check("replace", focus("qukeys.map"),
+        "0 2 1 224 0 0|-1 2 1 226 0 0|0 2 2 225 0 0|");
+  check("replace: still first", hold(2, 1), "LeftControl");
+
+  // Removing one, adding one on another key, and changing the timeout
+  focus("qukeys.map", "0 2 2 0 0 0");
+  focus("qukeys.map", "0 1 0 225 100 0");
+  focus("qukeys.timeout", "300");
+  check("remove and add", focus("qukeys.map"),
+        "0 1 0 225 100 0|0 2 1 224 0 0|-1 2 1 226 0 0|");
+  check("removed key", hold(2, 2), "9");
+  check("added key", hold(1, 0), "LeftShift");
+
+  boot(file);
+  check("reboot: table", focus("qukeys.map"),
+        "0 1 0 225 100 0|0 2 1 224 0 0|-1 2 1 226 0 0|");
+  check("reboot: timeout", focus("qukeys.timeout"), "300|");
+  check("reboot: replaced key", hold(2, 1), "LeftControl");
+  check("reboot: added key", hold(1, 0), "LeftShift");
+
+  // Moving the qukey on (1,0) to another key with qukeys puts it after
+  // that key's qukey for layer 0, but ahead of its qukey for all layers,
+  // which would hide it
+  focus("qukeys.map", "0 1 0 0 0 0");
+  focus("qukeys.map", "1 2 1 227 0 0");
+  check("move", focus("qukeys.map"), "0 2 1 224 0 0|1 2 1 227 0 0|-1 2 1 226 0 0|");
+  check("moved key", hold(1, 0), "Q");
+  host::setKey(1, 2, 1, Key_B);
+  Layer.on(1);
+  check("moved key: layer 1", hold(2, 1), "LeftGui");
+  Layer.off(1);
+
+  // A saved table isn't loaded if EEPROMSettings says the EEPROM's
+  // contents are invalid
+  boot(file, false);
+  check("invalid EEPROM: the sketch's table", focus("qukeys.map"),
+        "0 2 1 227 0 0|-1 2 1 226 0 0|0 2 2 225 0 0|");
+
+  remove(file);
+  std::cout << "config: " << checks - failures << " passed, " << failures << " failed\n";
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
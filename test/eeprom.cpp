@@ -0,0 +1,63 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The EEPROM stand-ins, for the tests that use QukeysConfig
+
+#include <EEPROM.h>
+#include <Kaleidoscope-EEPROM-Settings.h>
+
+EEPROMClass EEPROM;
+EEPROMSettings_ EEPROMSettings;
+
+void EEPROMClass::open(const char *file) {
+  file_ = file;
+  writes_ = 0;
+  memset(data_, 0xFF, sizeof(data_));
+  FILE *input = fopen(file, "rb");
+  if (input != nullptr) {
+    if (fread(data_, 1, sizeof(data_), input) != sizeof(data_))
+      memset(data_, 0xFF, sizeof(data_));
+    fclose(input);
+  }
+}
+
+uint8_t EEPROMClass::read(int pos) {
+  return data_[pos];
+}
+
+void EEPROMClass::update(int pos, uint8_t value) {
+  if (data_[pos] == value)
+    return;
+  data_[pos] = value;
+  writes_++;
+  if (file_ == nullptr)
+    return;
+  FILE *output = fopen(file_, "wb");
+  if (output == nullptr) {
+    perror(file_);
+    exit(EXIT_FAILURE);
+  }
+  fwrite(data_, 1, sizeof(data_), output);
+  fclose(output);
+}
+
+uint16_t EEPROMSettings_::requestSlice(uint16_t size) {
+  uint16_t start = next_;
+  next_ += size;
+  return start;
+}
@@ -0,0 +1,159 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks instantiations of the Qukeys engine other than `Qukeys`: one
+// for the first three rows with a queue of two keys and a 16-bit timer,
+// and one with a queue too long to be searched unrolled. Only `Qukeys`
+// is instantiated by the library, so this builds Qukeys.cpp itself.
+
+#include "../src/Kaleidoscope/Qukeys.cpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+typedef kaleidoscope::BasicQukeys<3, COLS, 2, uint16_t> SmallQukeys;
+typedef kaleidoscope::BasicQukeys<ROWS, COLS, 12, uint32_t> LongQukeys;
+template class kaleidoscope::BasicQukeys<3, COLS, 2, uint16_t>;
+template class kaleidoscope::BasicQukeys<ROWS, COLS, 12, uint32_t>;
+
+namespace {
+
+struct Event {
+  uint32_t time;
+  byte row;
+  byte col;
+  bool press;
+};
+
+int checks = 0;
+int failures = 0;
+
+bool previous_keyswitches[ROWS][COLS];
+
+// One pass of the main loop with `Engine` ahead of everything else (the
+// global `Qukeys` has no qukeys, so it passes every key through)
+template<typename Engine>
+void scanCycle() {
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      uint8_t key_state = ((host::keyswitch(row, col) ? IS_PRESSED : 0) |
+                           (previous_keyswitches[row][col] ? WAS_PRESSED : 0));
+      previous_keyswitches[row][col] = host::keyswitch(row, col);
+      if (KeyboardHardware.isKeyMasked(row, col)) {
+        if (!keyToggledOff(key_state))
+          continue;
+        KeyboardHardware.unMaskKey(row, col);
+      }
+      Key mapped_key = Key_NoKey;
+      if (Engine().onKeyswitchEvent(mapped_key, row, col, key_state) ==
+          kaleidoscope::EventHandlerResult::OK)
+        handleKeyswitchEvent(mapped_key, row, col, key_state);
+    }
+  }
+  Engine().beforeReportingState();
+  kaleidoscope::hid::sendKeyboardReport();
+  kaleidoscope::hid::releaseAllKeys();
+}
+
+template<typename Engine>
+void check(const char *name, kaleidoscope::Qukey qukey, const std::vector<Event> &events,
+           const std::vector<std::string> &expected) {
+  static kaleidoscope::Qukey table[1];
+  checks++;
+  host::reset();
+  memset(previous_keyswitches, 0, sizeof(previous_keyswitches));
+  table[0] = qukey;
+  Engine::qukeys = table;
+  Engine::qukeys_count = 1;
+  Engine().onSetup();
+  Kaleidoscope.setup();
+
+  size_t next = 0;
+  for (uint32_t time = 0; time <= events.back().time + 1000; time++) {
+    host::setTime(time);
+    for (; next < events.size() && events[next].time == time; next++)
+      host::setKeyswitch(events[next].row, events[next].col, events[next].press);
+    scanCycle<Engine>();
+  }
+
+  std::vector<std::string> reports;
+  for (const auto &report : host::reports)
+    reports.push_back(std::to_string(report.time) + ": " + host::reportKeys(report.data));
+  if (reports != expected) {
+    std::cout << "FAIL: " << name << "\n";
+    for (const auto &report : reports)
+      std::cout << "  " << report << "\n";
+    failures++;
+  }
+}
+
+} // namespace {
+
+int main() {
+  // Each instantiation has its own settings
+  SmallQukeys::setTimeout(100);
+  checks++;
+  if (SmallQukeys::getTimeout() != 100 || Qukeys.getTimeout() != 250 ||
+      LongQukeys::getTimeout() != 250) {
+    std::cout << "FAIL: separate time limits\n";
+    failures++;
+  }
+  SmallQukeys::setTimeout(250);
+
+  kaleidoscope::Qukey qukey(QUKEY_ALL_LAYERS, 2, 1, Key_LeftGui);
+  check<SmallQukeys>("hold", qukey, {{10, 2, 1, true}, {400, 2, 1, false}},
+  {"261: LeftGui", "400: (none)"});
+  // The third key doesn't fit in the queue, which flushes the qukey
+  // (the global Qukeys, with a queue of eight, would wait for it)
+  check<SmallQukeys>("full queue", qukey,
+  {{10, 2, 1, true}, {20, 2, 2, true}, {30, 2, 3, true}, {40, 2, 3, false},
+    {50, 2, 2, false}, {60, 2, 1, false}},
+  {"30: LeftGui", "30: LeftGui 9", "40: LeftGui 9 0", "40: LeftGui 9",
+   "50: LeftGui", "60: (none)"});
+  // Row 3 is past the engine's rows, so it's never queued
+  check<SmallQukeys>("past the last row", kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 3, 1, Key_LeftGui),
+  {{10, 3, 1, true}, {400, 3, 1, false}},
+  {"10: Backtick", "400: (none)"});
+
+  // Nine keys behind the qukey fit in the queue, so they're all decided
+  // by its time limit (the global Qukeys would overflow)
+  std::vector<Event> events = {{10, 2, 1, true}};
+  for (byte col = 2; col < 11; col++)
+    events.push_back({uint32_t(10 + col), 2, col, true});
+  for (byte col = 1; col < 11; col++)
+    events.push_back({uint32_t(400 + col), 2, col, false});
+  check<LongQukeys>("long queue", qukey, events,
+  {"261: LeftGui", "261: LeftGui 9", "261: LeftGui 9 0", "261: LeftGui 9 0 Enter",
+   "261: LeftGui 9 0 Enter Escape", "261: LeftGui 9 0 Enter Escape Backspace",
+   "261: LeftGui 9 0 Enter Escape Backspace Tab",
+   "261: LeftGui 9 0 Enter Escape Backspace Tab Spacebar",
+   "261: LeftGui 9 0 Enter Escape Backspace Tab Spacebar Minus",
+   "261: LeftGui 9 0 Enter Escape Backspace Tab Spacebar Minus Equals",
+   "401: 9 0 Enter Escape Backspace Tab Spacebar Minus Equals",
+   "402: 0 Enter Escape Backspace Tab Spacebar Minus Equals",
+   "403: Enter Escape Backspace Tab Spacebar Minus Equals",
+   "404: Escape Backspace Tab Spacebar Minus Equals",
+   "405: Backspace Tab Spacebar Minus Equals", "406: Tab Spacebar Minus Equals",
+   "407: Spacebar Minus Equals", "408: Minus Equals", "409: Equals", "410: (none)"});
+
+  std::cout << "engine: " << checks - failures << " passed, " << failures << " failed\n";
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
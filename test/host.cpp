@@ -0,0 +1,547 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "host.h"
+
+#include <Kaleidoscope-Qukeys.h>
+#include <kaleidoscope/hid.h>
+#include <Kaleidoscope-Ranges.h>
+
+#include <chrono>
+
+HostSerial Serial;
+HostKeyboardHardware KeyboardHardware;
+Layer_ Layer;
+Keyboard_ Keyboard;
+Kaleidoscope_ Kaleidoscope;
+
+namespace host {
+
+std::vector<Report> reports;
+
+static uint32_t now;
+static bool real_micros;
+
+static Key keymap[LAYERS][ROWS][COLS];
+static uint32_t layer_state;
+static uint8_t active_layers[ROWS][COLS];
+static Key live_composite_keymap[ROWS][COLS];
+
+static bool keyswitches[ROWS][COLS];
+static bool previous_keyswitches[ROWS][COLS];
+
+static std::string serial_input;
+static size_t serial_input_pos;
+static FILE *serial_output = stdout;
+
+static void updateActiveLayers() {
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      active_layers[row][col] = 0;
+      for (int8_t layer = LAYERS - 1; layer > 0; layer--) {
+        if (Layer.isOn(layer) && keymap[layer][row][col] != Key_Transparent) {
+          active_layers[row][col] = layer;
+          break;
+        }
+      }
+    }
+  }
+}
+
+void reset() {
+  for (uint8_t layer = 0; layer < LAYERS; layer++) {
+    for (byte row = 0; row < ROWS; row++) {
+      for (byte col = 0; col < COLS; col++) {
+        if (layer == 0) {
+          keymap[layer][row][col].flags = KEY_FLAGS;
+          keymap[layer][row][col].keyCode = Key_A.keyCode + row * COLS + col;
+        } else {
+          keymap[layer][row][col] = Key_Transparent;
+        }
+      }
+    }
+  }
+  layer_state = 1;
+  updateActiveLayers();
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      keyswitches[row][col] = false;
+      previous_keyswitches[row][col] = false;
+      live_composite_keymap[row][col] = keymap[0][row][col];
+      KeyboardHardware.unMaskKey(row, col);
+    }
+  }
+  Keyboard.releaseAll();
+  memset(&Keyboard.lastKeyReport, 0, sizeof(Keyboard.lastKeyReport));
+  reports.clear();
+  now = 0;
+}
+
+void setKey(uint8_t layer, byte row, byte col, Key key) {
+  keymap[layer][row][col] = key;
+  updateActiveLayers();
+  if (layer == 0)
+    live_composite_keymap[row][col] = key;
+}
+
+void setKeyswitch(byte row, byte col, bool pressed) {
+  keyswitches[row][col] = pressed;
+}
+
+bool keyswitch(byte row, byte col) {
+  return keyswitches[row][col];
+}
+
+void setTime(uint32_t ms) {
+  now = ms;
+}
+
+uint32_t time() {
+  return now;
+}
+
+void setRealMicros(bool real) {
+  real_micros = real;
+}
+
+void scanCycle() {
+  for (byte row = 0; row < ROWS; row++) {
+    for (byte col = 0; col < COLS; col++) {
+      uint8_t key_state = 0;
+      if (keyswitches[row][col])
+        key_state |= IS_PRESSED;
+      if (previous_keyswitches[row][col])
+        key_state |= WAS_PRESSED;
+      previous_keyswitches[row][col] = keyswitches[row][col];
+      handleKeyswitchEvent(Key_NoKey, row, col, key_state);
+    }
+  }
+  ::Qukeys.beforeReportingState();
+  kaleidoscope::hid::sendKeyboardReport();
+  kaleidoscope::hid::releaseAllKeys();
+}
+
+void setSerialInput(const std::string &input) {
+  serial_input = input;
+  serial_input_pos = 0;
+}
+
+void setSerialOutput(FILE *output) {
+  serial_output = output;
+}
+
+static const struct {
+  const char *name;
+  Key key;
+} key_names[] = {
+  { "A", Key_A }, { "B", Key_B }, { "C", Key_C }, { "D", Key_D },
+  { "E", Key_E }, { "F", Key_F }, { "G", Key_G }, { "H", Key_H },
+  { "I", Key_I }, { "J", Key_J }, { "K", Key_K }, { "L", Key_L },
+  { "M", Key_M }, { "N", Key_N }, { "O", Key_O }, { "P", Key_P },
+  { "Q", Key_Q }, { "R", Key_R }, { "S", Key_S }, { "T", Key_T },
+  { "U", Key_U }, { "V", Key_V }, { "W", Key_W }, { "X", Key_X },
+  { "Y", Key_Y }, { "Z", Key_Z },
+  { "1", Key_1 }, { "2", Key_2 }, { "3", Key_3 }, { "4", Key_4 },
+  { "5", Key_5 }, { "6", Key_6 }, { "7", Key_7 }, { "8", Key_8 },
+  { "9", Key_9 }, { "0", Key_0 },
+  { "Enter", Key_Enter }, { "Escape", Key_Escape },
+  { "Backspace", Key_Backspace }, { "Tab", Key_Tab },
+  { "Spacebar", Key_Spacebar }, { "Minus", Key_Minus },
+  { "Equals", Key_Equals }, { "LeftBracket", Key_LeftBracket },
+  { "RightBracket", Key_RightBracket }, { "Backslash", Key_Backslash },
+  { "Semicolon", Key_Semicolon }, { "Quote", Key_Quote },
+  { "Backtick", Key_Backtick }, { "Comma", Key_Comma },
+  { "Period", Key_Period }, { "Slash", Key_Slash },
+  { "F1", Key_F1 }, { "F2", Key_F2 }, { "F3", Key_F3 }, { "F4", Key_F4 },
+  { "F5", Key_F5 }, { "F6", Key_F6 }, { "F7", Key_F7 }, { "F8", Key_F8 },
+  { "F9", Key_F9 }, { "F10", Key_F10 }, { "F11", Key_F11 }, { "F12", Key_F12 },
+  { "Home", Key_Home }, { "PageUp", Key_PageUp }, { "Delete", Key_Delete },
+  { "End", Key_End }, { "PageDown", Key_PageDown },
+  { "RightArrow", Key_RightArrow }, { "LeftArrow", Key_LeftArrow },
+  { "DownArrow", Key_DownArrow }, { "UpArrow", Key_UpArrow },
+  { "LeftControl", Key_LeftControl }, { "LeftShift", Key_LeftShift },
+  { "LeftAlt", Key_LeftAlt }, { "LeftGui", Key_LeftGui },
+  { "RightControl", Key_RightControl }, { "RightShift", Key_RightShift },
+  { "RightAlt", Key_RightAlt }, { "RightGui", Key_RightGui },
+  { "NoKey", Key_NoKey }, { "Transparent", Key_Transparent },
+};
+
+static std::string keycodeName(uint8_t keycode) {
+  for (const auto &entry : key_names) {
+    if (entry.key.flags == KEY_FLAGS && entry.key.keyCode == keycode)
+      return entry.name;
+  }
+  char buffer[8];
+  snprintf(buffer, sizeof(buffer), "0x%02X", keycode);
+  return buffer;
+}
+
+std::string keyName(Key key) {
+  for (const auto &entry : key_names) {
+    if (entry.key == key)
+      return entry.name;
+  }
+  char buffer[32];
+  if (key.flags == (SYNTHETIC | SWITCH_TO_KEYMAP)) {
+    if (key.keyCode >= MOMENTARY_OFFSET)
+      snprintf(buffer, sizeof(buffer), "ShiftToLayer(%u)", key.keyCode - MOMENTARY_OFFSET);
+    else
+      snprintf(buffer, sizeof(buffer), "LockLayer(%u)", key.keyCode);
+    return buffer;
+  }
+  if (key.raw >= kaleidoscope::ranges::DUM_FIRST && key.raw <= kaleidoscope::ranges::DUM_LAST) {
+    uint8_t modifier = Key_LeftControl.keyCode + ((key.raw - kaleidoscope::ranges::DUM_FIRST) >> 8);
+    return "MT(" + keycodeName(modifier) + "," + keycodeName(key.keyCode) + ")";
+  }
+  if (key.raw >= kaleidoscope::ranges::DUL_FIRST && key.raw <= kaleidoscope::ranges::DUL_LAST) {
+    snprintf(buffer, sizeof(buffer), "LT(%u,", (key.raw - kaleidoscope::ranges::DUL_FIRST) >> 8);
+    return buffer + keycodeName(key.keyCode) + ")";
+  }
+  snprintf(buffer, sizeof(buffer), "0x%04X", key.raw);
+  return buffer;
+}
+
+static bool parsePlainKey(const std::string &name, Key &key) {
+  for (const auto &entry : key_names) {
+    if (name == entry.name) {
+      key = entry.key;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parseNumber(const std::string &text, unsigned long &number) {
+  char *end;
+  number = strtoul(text.c_str(), &end, 0);
+  return !text.empty() && *end == '\0';
+}
+
+bool parseKey(const std::string &name, Key &key) {
+  if (parsePlainKey(name, key))
+    return true;
+
+  size_t open = name.find('(');
+  if (open != std::string::npos && name.back() == ')') {
+    std::string function = name.substr(0, open);
+    std::string argument = name.substr(open + 1, name.size() - open - 2);
+    std::string second;
+    size_t comma = argument.find(',');
+    if (comma != std::string::npos) {
+      second = argument.substr(comma + 1);
+      argument = argument.substr(0, comma);
+    }
+    unsigned long layer;
+    Key modifier, plain;
+    if ((function == "ShiftToLayer" || function == "LockLayer") && second.empty() &&
+        parseNumber(argument, layer) && layer < LAYERS) {
+      key.flags = SYNTHETIC | SWITCH_TO_KEYMAP;
+      key.keyCode = layer + (function == "ShiftToLayer" ? MOMENTARY_OFFSET : 0);
+      return true;
+    }
+    if (function == "MT" && parsePlainKey(argument, modifier) && parsePlainKey(second, plain) &&
+        modifier.keyCode >= Key_LeftControl.keyCode && modifier.keyCode <= Key_RightGui.keyCode) {
+      key.raw = kaleidoscope::ranges::DUM_FIRST +
+                ((modifier.keyCode - Key_LeftControl.keyCode) << 8) + plain.keyCode;
+      return true;
+    }
+    if (function == "LT" && parseNumber(argument, layer) && layer < LAYERS &&
+        parsePlainKey(second, plain)) {
+      key.raw = kaleidoscope::ranges::DUL_FIRST + (layer << 8) + plain.keyCode;
+      return true;
+    }
+    return false;
+  }
+
+  unsigned long raw;
+  if (!parseNumber(name, raw) || raw > 0xFFFF)
+    return false;
+  key.raw = raw;
+  return true;
+}
+
+std::string reportKeys(const HID_KeyboardReport_Data_t &report) {
+  std::string keys;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (bitRead(report.modifiers, i))
+      keys += " " + keycodeName(Key_LeftControl.keyCode + i);
+  }
+  for (uint8_t keycode = 0; keycode < KEY_BYTES * 8; keycode++) {
+    if (bitRead(report.keys[keycode / 8], keycode % 8))
+      keys += " " + keycodeName(keycode);
+  }
+  return keys.empty() ? "(none)" : keys.substr(1);
+}
+
+} // namespace host {
+
+// Arduino
+
+uint32_t millis() {
+  return host::now;
+}
+
+uint32_t micros() {
+  if (host::real_micros) {
+    auto elapsed = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  }
+  return host::now * 1000;
+}
+
+int HostSerial::available() {
+  return host::serial_input.size() - host::serial_input_pos;
+}
+
+int HostSerial::peek() {
+  if (!available())
+    return -1;
+  return static_cast<unsigned char>(host::serial_input[host::serial_input_pos]);
+}
+
+int HostSerial::read() {
+  int c = peek();
+  if (c >= 0)
+    host::serial_input_pos++;
+  return c;
+}
+
+// Like Arduino's `Stream::parseInt()`: skips anything that can't start a
+// number, and returns 0 if there's no number left
+long HostSerial::parseInt() {
+  while (available() && peek() != '-' && (peek() < '0' || peek() > '9'))
+    read();
+  bool negative = false;
+  if (peek() == '-') {
+    negative = true;
+    read();
+  }
+  long value = 0;
+  while (peek() >= '0' && peek() <= '9')
+    value = value * 10 + (read() - '0');
+  return negative ? -value : value;
+}
+
+size_t HostSerial::write(uint8_t b) {
+  return fwrite(&b, 1, 1, host::serial_output);
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size) {
+  return fwrite(buffer, 1, size, host::serial_output);
+}
+
+size_t HostSerial::print(const char *s) {
+  return fputs(s, host::serial_output) < 0 ? 0 : strlen(s);
+}
+
+size_t HostSerial::print(char c) {
+  return write(c);
+}
+
+size_t HostSerial::print(unsigned char n, int base) {
+  return print(static_cast<unsigned long>(n), base);
+}
+
+size_t HostSerial::print(int n, int base) {
+  return print(static_cast<long>(n), base);
+}
+
+size_t HostSerial::print(unsigned int n, int base) {
+  return print(static_cast<unsigned long>(n), base);
+}
+
+size_t HostSerial::print(long n, int base) {
+  if (base == DEC)
+    return fprintf(host::serial_output, "%ld", n);
+  return print(static_cast<unsigned long>(n), base);
+}
+
+size_t HostSerial::print(unsigned long n, int base) {
+  return fprintf(host::serial_output, base == HEX ? "%lX" : "%lu", n);
+}
+
+size_t HostSerial::println() {
+  return print("\n");
+}
+
+// Kaleidoscope core
+
+void HostKeyboardHardware::maskKey(byte row, byte col) {
+  masks_[row][col] = true;
+}
+
+void HostKeyboardHardware::unMaskKey(byte row, byte col) {
+  masks_[row][col] = false;
+}
+
+bool HostKeyboardHardware::isKeyMasked(byte row, byte col) {
+  return masks_[row][col];
+}
+
+Key Layer_::lookup(byte row, byte col) {
+  return host::live_composite_keymap[row][col];
+}
+
+uint8_t Layer_::lookupActiveLayer(byte row, byte col) {
+  return host::active_layers[row][col];
+}
+
+Key Layer_::getKey(uint8_t layer, byte row, byte col) {
+  return host::keymap[layer][row][col];
+}
+
+uint32_t Layer_::getLayerState() {
+  return host::layer_state;
+}
+
+bool Layer_::isOn(uint8_t layer) {
+  return bitRead(host::layer_state, layer);
+}
+
+void Layer_::on(uint8_t layer) {
+  bitSet(host::layer_state, layer);
+  host::updateActiveLayers();
+}
+
+void Layer_::off(uint8_t layer) {
+  bitClear(host::layer_state, layer);
+  host::updateActiveLayers();
+}
+
+void Layer_::updateLiveCompositeKeymap(byte row, byte col, Key mappedKey) {
+  host::live_composite_keymap[row][col] = mappedKey;
+}
+
+void Layer_::updateLiveCompositeKeymap(byte row, byte col) {
+  host::live_composite_keymap[row][col] = getKey(lookupActiveLayer(row, col), row, col);
+}
+
+// Layer keys: momentary layer shifts stay on while any key shifting to
+// that layer is held; locking keys toggle their layer.
+static void handleKeymapKeyswitchEvent(Key keymapEntry, uint8_t keyState) {
+  if (keymapEntry.keyCode >= MOMENTARY_OFFSET) {
+    uint8_t target = keymapEntry.keyCode - MOMENTARY_OFFSET;
+    if (keyIsPressed(keyState)) {
+      if (!Layer.isOn(target))
+        Layer.on(target);
+    } else if (keyToggledOff(keyState)) {
+      Layer.off(target);
+    }
+  } else if (keyToggledOn(keyState)) {
+    if (Layer.isOn(keymapEntry.keyCode))
+      Layer.off(keymapEntry.keyCode);
+    else
+      Layer.on(keymapEntry.keyCode);
+  }
+}
+
+void handleKeyswitchEvent(Key mappedKey, byte row, byte col, uint8_t keyState) {
+  if (row < ROWS && col < COLS) {
+    // A key's keycode is looked up when it toggles on, and stays the
+    // same until it's released, whatever happens to the layers meanwhile
+    if (keyToggledOn(keyState)) {
+      if (mappedKey == Key_NoKey)
+        Layer.updateLiveCompositeKeymap(row, col);
+      else
+        Layer.updateLiveCompositeKeymap(row, col, mappedKey);
+    }
+
+    if (KeyboardHardware.isKeyMasked(row, col)) {
+      if (keyToggledOff(keyState))
+        KeyboardHardware.unMaskKey(row, col);
+      else
+        return;
+    }
+
+    if (mappedKey == Key_NoKey)
+      mappedKey = Layer.lookup(row, col);
+  }
+
+  if (::Qukeys.onKeyswitchEvent(mappedKey, row, col, keyState) != kaleidoscope::EventHandlerResult::OK)
+    return;
+
+  if (mappedKey.flags == (SYNTHETIC | SWITCH_TO_KEYMAP)) {
+    handleKeymapKeyswitchEvent(mappedKey, keyState);
+    return;
+  }
+  if (mappedKey == Key_NoKey || (mappedKey.flags & SYNTHETIC))
+    return;
+
+  if (keyIsPressed(keyState))
+    kaleidoscope::hid::pressKey(mappedKey);
+}
+
+void Kaleidoscope_::setup() {
+  ::Qukeys.onSetup();
+}
+
+void Kaleidoscope_::loop() {
+  host::scanCycle();
+}
+
+namespace kaleidoscope {
+namespace hid {
+
+void pressKey(Key pressed_key) {
+  if (pressed_key.flags & SHIFT_HELD)
+    Keyboard.press(Key_LeftShift.keyCode);
+  if (pressed_key.flags & CTRL_HELD)
+    Keyboard.press(Key_LeftControl.keyCode);
+  if (pressed_key.flags & LALT_HELD)
+    Keyboard.press(Key_LeftAlt.keyCode);
+  if (pressed_key.flags & RALT_HELD)
+    Keyboard.press(Key_RightAlt.keyCode);
+  if (pressed_key.flags & GUI_HELD)
+    Keyboard.press(Key_LeftGui.keyCode);
+  Keyboard.press(pressed_key.keyCode);
+}
+
+void releaseAllKeys() {
+  Keyboard.releaseAll();
+}
+
+void sendKeyboardReport() {
+  Keyboard.sendReport();
+}
+
+} // namespace hid {
+} // namespace kaleidoscope {
+
+size_t Keyboard_::press(uint8_t k) {
+  if (k >= Key_LeftControl.keyCode && k <= Key_RightGui.keyCode) {
+    bitSet(keyReport.modifiers, k - Key_LeftControl.keyCode);
+    return 1;
+  }
+  if (k < KEY_BYTES * 8) {
+    bitSet(keyReport.keys[k / 8], k % 8);
+    return 1;
+  }
+  return 0;
+}
+
+void Keyboard_::releaseAll() {
+  memset(&keyReport, 0, sizeof(keyReport));
+}
+
+int Keyboard_::sendReport() {
+  if (memcmp(&keyReport, &lastKeyReport, sizeof(keyReport)) == 0)
+    return 0;
+  host::reports.push_back({host::now, keyReport});
+  memcpy(&lastKeyReport, &keyReport, sizeof(keyReport));
+  return 1;
+}
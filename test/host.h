@@ -0,0 +1,78 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A virtual keyboard for running Qukeys on the host: a matrix of
+// keyswitches the test presses and releases, a keymap with a few layers,
+// a clock that only moves when told to, and a list of every HID report
+// sent. Each call to `scanCycle()` is one pass of Kaleidoscope's main
+// loop, so a test normally advances the clock by 1ms per cycle.
+
+#pragma once
+
+#include <Kaleidoscope.h>
+#include <MultiReport/Keyboard.h>
+
+#include <string>
+#include <vector>
+
+namespace host {
+
+constexpr uint8_t LAYERS = 8;
+
+struct Report {
+  uint32_t time;
+  HID_KeyboardReport_Data_t data;
+};
+
+// Every report sent since the last `reset()`, oldest first
+extern std::vector<Report> reports;
+
+// Releases every keyswitch, turns off every layer but 0, clears the
+// reports and sets the clock to 0. The keymap goes back to the default:
+// on layer 0, the key at (row, col) has keycode 4 + (row * COLS + col),
+// starting with `Key_A`; every other layer is transparent.
+void reset();
+
+void setKey(uint8_t layer, byte row, byte col, Key key);
+void setKeyswitch(byte row, byte col, bool pressed);
+bool keyswitch(byte row, byte col);
+
+void setTime(uint32_t ms);
+uint32_t time();
+// Make `micros()` read the host's real clock, instead of following the
+// test's one (for the benchmark, which times itself with it)
+void setRealMicros(bool real);
+
+// One pass of the main loop: an event for every key, then the
+// `beforeReportingState()` hook, then the report is sent (if it changed)
+// and cleared.
+void scanCycle();
+
+void setSerialInput(const std::string &input);
+void setSerialOutput(FILE *output);
+
+// Keycode names, as used in test scripts: `Key_` names without the
+// prefix (`A`, `LeftShift`), `ShiftToLayer(1)`, `LockLayer(1)`,
+// `MT(LeftShift,J)`, `LT(1,J)`, or a raw number.
+std::string keyName(Key key);
+bool parseKey(const std::string &name, Key &key);
+
+// The keys in a report, modifiers first, separated by spaces
+std::string reportKeys(const HID_KeyboardReport_Data_t &report);
+
+} // namespace host {
@@ -0,0 +1,47 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for the Arduino EEPROM library, backed by a file, so a
+// test can "reboot" by opening the same file again.
+
+#pragma once
+
+#include <Arduino.h>
+
+class EEPROMClass {
+ public:
+  // Read the contents from `file` (all 0xFF, like a blank EEPROM, if it
+  // doesn't exist yet); every change is written back to it
+  void open(const char *file);
+  uint16_t length() {
+    return sizeof(data_);
+  }
+  uint8_t read(int pos);
+  void update(int pos, uint8_t value);
+  // Number of bytes actually written since it was opened
+  unsigned writes() {
+    return writes_;
+  }
+
+ private:
+  uint8_t data_[1024];
+  const char *file_ = nullptr;
+  unsigned writes_ = 0;
+};
+
+extern EEPROMClass EEPROM;
@@ -0,0 +1,44 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for Kaleidoscope-EEPROM-Settings: slices are handed out
+// one after the other, after a 16-byte header (like the real plugin's).
+
+#pragma once
+
+#include <Kaleidoscope.h>
+
+class EEPROMSettings_ {
+ public:
+  uint16_t requestSlice(uint16_t size);
+  void seal() {}
+  // False if the EEPROM's contents can't be trusted; the real plugin
+  // checks its header and checksum, tests call invalidate()
+  bool isValid() {
+    return valid_;
+  }
+  void invalidate() {
+    valid_ = false;
+  }
+
+ private:
+  uint16_t next_ = 16;
+  bool valid_ = true;
+};
+
+extern EEPROMSettings_ EEPROMSettings;
@@ -0,0 +1,46 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stdint.h>
+
+namespace kaleidoscope {
+namespace ranges {
+
+enum : uint16_t {
+  FIRST = 0xc000,
+  KALEIDOSCOPE_FIRST = FIRST,
+  OS_FIRST,
+  OSM_FIRST = OS_FIRST,
+  OSM_LAST = OSM_FIRST + 7,
+  OSL_FIRST,
+  OSL_LAST = OSL_FIRST + 7,
+  OS_LAST = OSL_LAST,
+  DU_FIRST,
+  DUM_FIRST = DU_FIRST,
+  DUM_LAST = DUM_FIRST + (8 << 8),
+  DUL_FIRST,
+  DUL_LAST = DUL_FIRST + (8 << 8),
+  DU_LAST = DUL_LAST,
+
+  SAFE_START,
+  KALEIDOSCOPE_SAFE_START = SAFE_START
+};
+
+} // namespace ranges {
+} // namespace kaleidoscope {
@@ -0,0 +1,235 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for the parts of the Kaleidoscope core that Qukeys uses:
+// the Key type and keycodes, a 4x16 key matrix (the Model01's shape), the
+// layer stack, and the keyswitch event handler. The behaviour lives in
+// test/host.cpp, which follows the real core closely enough for the
+// reports it records to be the ones a real keyboard would send.
+
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef KALEIDOSCOPE_ENABLE_V1_PLUGIN_API
+#define KALEIDOSCOPE_ENABLE_V1_PLUGIN_API 1
+#endif
+
+#define ROWS 4
+#define COLS 16
+
+typedef union Key_ {
+  struct {
+    uint8_t keyCode;
+    uint8_t flags;
+  };
+  uint16_t raw;
+
+  inline bool operator==(uint16_t rhs) const {
+    return this->raw == rhs;
+  }
+  inline bool operator==(const Key_ rhs) const {
+    return this->raw == rhs.raw;
+  }
+  inline bool operator!=(uint16_t rhs) const {
+    return this->raw != rhs;
+  }
+  inline bool operator!=(const Key_ rhs) const {
+    return this->raw != rhs.raw;
+  }
+} Key;
+
+#define KEY_FLAGS         0b00000000
+#define CTRL_HELD         0b00000001
+#define LALT_HELD         0b00000010
+#define RALT_HELD         0b00000100
+#define SHIFT_HELD        0b00001000
+#define GUI_HELD          0b00010000
+#define SYNTHETIC         0b01000000
+#define RESERVED          0b10000000
+
+// Synthetic keys
+#define SWITCH_TO_KEYMAP  0b00000100
+
+// Key states
+#define IS_PRESSED        0b00000001
+#define WAS_PRESSED       0b00000010
+#define INJECTED          0b10000000
+
+#define keyIsPressed(keyState)   ((keyState) & IS_PRESSED)
+#define keyWasPressed(keyState)  ((keyState) & WAS_PRESSED)
+#define keyToggledOn(keyState)   (keyIsPressed(keyState) && !keyWasPressed(keyState))
+#define keyToggledOff(keyState)  (keyWasPressed(keyState) && !keyIsPressed(keyState))
+
+#define Key_NoKey (Key){ .keyCode = 0, .flags = KEY_FLAGS }
+#define Key_Transparent (Key){ .keyCode = 0xFF, .flags = 0xFF }
+#define ___ Key_Transparent
+#define XXX Key_NoKey
+
+#define Key_A (Key){ .keyCode = 0x04, .flags = KEY_FLAGS }
+#define Key_B (Key){ .keyCode = 0x05, .flags = KEY_FLAGS }
+#define Key_C (Key){ .keyCode = 0x06, .flags = KEY_FLAGS }
+#define Key_D (Key){ .keyCode = 0x07, .flags = KEY_FLAGS }
+#define Key_E (Key){ .keyCode = 0x08, .flags = KEY_FLAGS }
+#define Key_F (Key){ .keyCode = 0x09, .flags = KEY_FLAGS }
+#define Key_G (Key){ .keyCode = 0x0A, .flags = KEY_FLAGS }
+#define Key_H (Key){ .keyCode = 0x0B, .flags = KEY_FLAGS }
+#define Key_I (Key){ .keyCode = 0x0C, .flags = KEY_FLAGS }
+#define Key_J (Key){ .keyCode = 0x0D, .flags = KEY_FLAGS }
+#define Key_K (Key){ .keyCode = 0x0E, .flags = KEY_FLAGS }
+#define Key_L (Key){ .keyCode = 0x0F, .flags = KEY_FLAGS }
+#define Key_M (Key){ .keyCode = 0x10, .flags = KEY_FLAGS }
+#define Key_N (Key){ .keyCode = 0x11, .flags = KEY_FLAGS }
+#define Key_O (Key){ .keyCode = 0x12, .flags = KEY_FLAGS }
+#define Key_P (Key){ .keyCode = 0x13, .flags = KEY_FLAGS }
+#define Key_Q (Key){ .keyCode = 0x14, .flags = KEY_FLAGS }
+#define Key_R (Key){ .keyCode = 0x15, .flags = KEY_FLAGS }
+#define Key_S (Key){ .keyCode = 0x16, .flags = KEY_FLAGS }
+#define Key_T (Key){ .keyCode = 0x17, .flags = KEY_FLAGS }
+#define Key_U (Key){ .keyCode = 0x18, .flags = KEY_FLAGS }
+#define Key_V (Key){ .keyCode = 0x19, .flags = KEY_FLAGS }
+#define Key_W (Key){ .keyCode = 0x1A, .flags = KEY_FLAGS }
+#define Key_X (Key){ .keyCode = 0x1B, .flags = KEY_FLAGS }
+#define Key_Y (Key){ .keyCode = 0x1C, .flags = KEY_FLAGS }
+#define Key_Z (Key){ .keyCode = 0x1D, .flags = KEY_FLAGS }
+#define Key_1 (Key){ .keyCode = 0x1E, .flags = KEY_FLAGS }
+#define Key_2 (Key){ .keyCode = 0x1F, .flags = KEY_FLAGS }
+#define Key_3 (Key){ .keyCode = 0x20, .flags = KEY_FLAGS }
+#define Key_4 (Key){ .keyCode = 0x21, .flags = KEY_FLAGS }
+#define Key_5 (Key){ .keyCode = 0x22, .flags = KEY_FLAGS }
+#define Key_6 (Key){ .keyCode = 0x23, .flags = KEY_FLAGS }
+#define Key_7 (Key){ .keyCode = 0x24, .flags = KEY_FLAGS }
+#define Key_8 (Key){ .keyCode = 0x25, .flags = KEY_FLAGS }
+#define Key_9 (Key){ .keyCode = 0x26, .flags = KEY_FLAGS }
+#define Key_0 (Key){ .keyCode = 0x27, .flags = KEY_FLAGS }
+#define Key_Enter (Key){ .keyCode = 0x28, .flags = KEY_FLAGS }
+#define Key_Escape (Key){ .keyCode = 0x29, .flags = KEY_FLAGS }
+#define Key_Backspace (Key){ .keyCode = 0x2A, .flags = KEY_FLAGS }
+#define Key_Tab (Key){ .keyCode = 0x2B, .flags = KEY_FLAGS }
+#define Key_Spacebar (Key){ .keyCode = 0x2C, .flags = KEY_FLAGS }
+#define Key_Minus (Key){ .keyCode = 0x2D, .flags = KEY_FLAGS }
+#define Key_Equals (Key){ .keyCode = 0x2E, .flags = KEY_FLAGS }
+#define Key_LeftBracket (Key){ .keyCode = 0x2F, .flags = KEY_FLAGS }
+#define Key_RightBracket (Key){ .keyCode = 0x30, .flags = KEY_FLAGS }
+#define Key_Backslash (Key){ .keyCode = 0x31, .flags = KEY_FLAGS }
+#define Key_Semicolon (Key){ .keyCode = 0x33, .flags = KEY_FLAGS }
+#define Key_Quote (Key){ .keyCode = 0x34, .flags = KEY_FLAGS }
+#define Key_Backtick (Key){ .keyCode = 0x35, .flags = KEY_FLAGS }
+#define Key_Comma (Key){ .keyCode = 0x36, .flags = KEY_FLAGS }
+#define Key_Period (Key){ .keyCode = 0x37, .flags = KEY_FLAGS }
+#define Key_Slash (Key){ .keyCode = 0x38, .flags = KEY_FLAGS }
+#define Key_F1 (Key){ .keyCode = 0x3A, .flags = KEY_FLAGS }
+#define Key_F2 (Key){ .keyCode = 0x3B, .flags = KEY_FLAGS }
+#define Key_F3 (Key){ .keyCode = 0x3C, .flags = KEY_FLAGS }
+#define Key_F4 (Key){ .keyCode = 0x3D, .flags = KEY_FLAGS }
+#define Key_F5 (Key){ .keyCode = 0x3E, .flags = KEY_FLAGS }
+#define Key_F6 (Key){ .keyCode = 0x3F, .flags = KEY_FLAGS }
+#define Key_F7 (Key){ .keyCode = 0x40, .flags = KEY_FLAGS }
+#define Key_F8 (Key){ .keyCode = 0x41, .flags = KEY_FLAGS }
+#define Key_F9 (Key){ .keyCode = 0x42, .flags = KEY_FLAGS }
+#define Key_F10 (Key){ .keyCode = 0x43, .flags = KEY_FLAGS }
+#define Key_F11 (Key){ .keyCode = 0x44, .flags = KEY_FLAGS }
+#define Key_F12 (Key){ .keyCode = 0x45, .flags = KEY_FLAGS }
+#define Key_Home (Key){ .keyCode = 0x4A, .flags = KEY_FLAGS }
+#define Key_PageUp (Key){ .keyCode = 0x4B, .flags = KEY_FLAGS }
+#define Key_Delete (Key){ .keyCode = 0x4C, .flags = KEY_FLAGS }
+#define Key_End (Key){ .keyCode = 0x4D, .flags = KEY_FLAGS }
+#define Key_PageDown (Key){ .keyCode = 0x4E, .flags = KEY_FLAGS }
+#define Key_RightArrow (Key){ .keyCode = 0x4F, .flags = KEY_FLAGS }
+#define Key_LeftArrow (Key){ .keyCode = 0x50, .flags = KEY_FLAGS }
+#define Key_DownArrow (Key){ .keyCode = 0x51, .flags = KEY_FLAGS }
+#define Key_UpArrow (Key){ .keyCode = 0x52, .flags = KEY_FLAGS }
+#define Key_LeftControl (Key){ .keyCode = 0xE0, .flags = KEY_FLAGS }
+#define Key_LeftShift (Key){ .keyCode = 0xE1, .flags = KEY_FLAGS }
+#define Key_LeftAlt (Key){ .keyCode = 0xE2, .flags = KEY_FLAGS }
+#define Key_LeftGui (Key){ .keyCode = 0xE3, .flags = KEY_FLAGS }
+#define Key_RightControl (Key){ .keyCode = 0xE4, .flags = KEY_FLAGS }
+#define Key_RightShift (Key){ .keyCode = 0xE5, .flags = KEY_FLAGS }
+#define Key_RightAlt (Key){ .keyCode = 0xE6, .flags = KEY_FLAGS }
+#define Key_RightGui (Key){ .keyCode = 0xE7, .flags = KEY_FLAGS }
+
+#include <key_defs_keymaps.h>
+
+class HostKeyboardHardware {
+ public:
+  void maskKey(byte row, byte col);
+  void unMaskKey(byte row, byte col);
+  bool isKeyMasked(byte row, byte col);
+
+ private:
+  bool masks_[ROWS][COLS];
+};
+
+extern HostKeyboardHardware KeyboardHardware;
+
+class Layer_ {
+ public:
+  static Key lookup(byte row, byte col);
+  static uint8_t lookupActiveLayer(byte row, byte col);
+  static Key getKey(uint8_t layer, byte row, byte col);
+  static uint32_t getLayerState();
+  static bool isOn(uint8_t layer);
+  static void on(uint8_t layer);
+  static void off(uint8_t layer);
+  static void updateLiveCompositeKeymap(byte row, byte col, Key mappedKey);
+  static void updateLiveCompositeKeymap(byte row, byte col);
+};
+
+extern Layer_ Layer;
+
+void handleKeyswitchEvent(Key mappedKey, byte row, byte col, uint8_t keyState);
+
+namespace kaleidoscope {
+
+enum class EventHandlerResult {
+  OK,
+  EVENT_CONSUMED,
+  ABORT,
+};
+
+class Plugin {};
+
+} // namespace kaleidoscope {
+
+class Kaleidoscope_ {
+ public:
+  // Qukeys is the only plugin on the host, so these call its hooks directly
+  void setup();
+  void loop();
+
+#if KALEIDOSCOPE_ENABLE_V1_PLUGIN_API
+  // Only here so that `Qukeys.begin()` builds; the hooks are never called
+  typedef Key(*eventHandlerHook)(Key mappedKey, byte row, byte col, uint8_t keyState);
+  typedef void (*loopHook)(bool postClear);
+
+  void useEventHandlerHook(eventHandlerHook) {}
+  void useLoopHook(loopHook) {}
+#endif
+};
+
+extern Kaleidoscope_ Kaleidoscope;
+
+// What sketches use to define their keymaps and plugins, so the examples
+// build on the host. The keymaps aren't used: the host has its own (see
+// test/host.h), and plugins' hooks are called directly.
+#define KEYMAPS(layers...)						\
+  const Key keymaps[][ROWS][COLS] PROGMEM = { layers };			\
+  uint8_t layer_count = sizeof(keymaps) / sizeof(*keymaps);
+
+#define KALEIDOSCOPE_INIT_PLUGINS(plugins...)				\
+  static_assert(true, "plugins' hooks are called directly on the host")
@@ -0,0 +1,43 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <Arduino.h>
+
+// A bitmap of the usages 0x00..0xDF, plus the modifier byte (0xE0..0xE7)
+#define KEY_BYTES 28
+
+typedef union {
+  struct {
+    uint8_t modifiers;
+    uint8_t keys[KEY_BYTES];
+  };
+  uint8_t allkeys[1 + KEY_BYTES];
+} HID_KeyboardReport_Data_t;
+
+class Keyboard_ {
+ public:
+  size_t press(uint8_t k);
+  void releaseAll();
+  int sendReport();
+
+  HID_KeyboardReport_Data_t keyReport;
+  HID_KeyboardReport_Data_t lastKeyReport;
+};
+
+extern Keyboard_ Keyboard;
@@ -0,0 +1,23 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#define LAYER_SHIFT_OFFSET 42
+#define MOMENTARY_OFFSET LAYER_SHIFT_OFFSET
+
+#define ShiftToLayer(n) (Key){ .keyCode = (uint8_t)((n) + LAYER_SHIFT_OFFSET), .flags = KEY_FLAGS | SYNTHETIC | SWITCH_TO_KEYMAP }
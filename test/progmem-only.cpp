@@ -0,0 +1,97 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks a qukeys table defined with `QUKEYS_PROGMEM()`, in a build with
+// QUKEYS_PROGMEM_ONLY set (so there's no SRAM table or index at all).
+// Scripts can't define a table at compile time, so this one is in code.
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+static_assert(QUKEYS_PROGMEM_ONLY, "build this with -DQUKEYS_PROGMEM_ONLY=1");
+
+namespace {
+
+struct Event {
+  uint32_t time;
+  byte row;
+  byte col;
+  bool press;
+};
+
+int checks = 0;
+int failures = 0;
+
+void check(const char *name, const std::vector<Event> &events,
+           const std::vector<std::string> &expected) {
+  checks++;
+  host::reset();
+  host::setKey(0, 3, 6, ShiftToLayer(1));
+  host::setKey(1, 2, 1, Key_B);
+  Kaleidoscope.setup();
+
+  size_t next = 0;
+  for (uint32_t time = 0; time <= events.back().time + 1000; time++) {
+    host::setTime(time);
+    for (; next < events.size() && events[next].time == time; next++)
+      host::setKeyswitch(events[next].row, events[next].col, events[next].press);
+    Kaleidoscope.loop();
+  }
+
+  std::vector<std::string> reports;
+  for (const auto &report : host::reports)
+    reports.push_back(std::to_string(report.time) + ": " + host::reportKeys(report.data));
+  if (reports != expected) {
+    std::cout << "FAIL: " << name << "\n";
+    for (const auto &report : reports)
+      std::cout << "  " << report << "\n";
+    failures++;
+  }
+}
+
+} // namespace {
+
+int main() {
+  // The same key has a different qukey on layer 1 (where it isn't
+  // transparent)
+  QUKEYS_PROGMEM(
+    kaleidoscope::Qukey(0, 2, 1, Key_LeftGui),
+    kaleidoscope::Qukey(1, 2, 1, Key_LeftAlt),
+    kaleidoscope::Qukey(QUKEY_ALL_LAYERS, 2, 2, Key_LeftShift, 100)
+  )
+
+  check("tap", {{10, 2, 1, true}, {50, 2, 1, false}},
+  {"50: 8", "51: (none)"});
+  check("hold", {{10, 2, 1, true}, {400, 2, 1, false}},
+  {"261: LeftGui", "400: (none)"});
+  check("layer 1", {{10, 3, 6, true}, {20, 2, 1, true}, {400, 2, 1, false}, {410, 3, 6, false}},
+  {"271: LeftAlt", "400: (none)"});
+  check("all layers", {{10, 3, 6, true}, {20, 2, 2, true}, {400, 2, 2, false}, {410, 3, 6, false}},
+  {"121: LeftShift", "400: (none)"});
+  check("not a qukey", {{10, 2, 3, true}, {50, 2, 3, false}},
+  {"10: 0", "50: (none)"});
+
+  std::cout << "progmem-only: " << checks - failures << " passed, " << failures << " failed\n";
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,484 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs a script of key presses and releases through Qukeys on the
+// virtual keyboard in host.cpp, and prints every HID report sent. See
+// test/scripts for examples of the format:
+//
+//     # Settings and keymap, before any events
+//     timeout 200
+//     key 0 (3,6) E
+//     qukey 0 (2,1) LeftGui
+//     # Events, in order of time (in ms)
+//     press (2,1) at 10
+//     release (2,1) at 50
+//
+// Any number of scripts can be given; they're read in order, as if they
+// were one (`include <file>` in a script reads another one in its
+// place). The output is one line per report:
+//
+//     report at 50: E
+//
+// Exits with status 77 (skipped) if the script `require`s a feature
+// that isn't compiled in, so `make test` can tell it from a failure.
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "host.h"
+
+#define EXIT_SKIP 77
+
+namespace {
+
+struct Event {
+  uint32_t time;
+  byte row;
+  byte col;
+  bool press;
+};
+
+struct Script {
+  std::vector<Event> events;
+  std::vector<kaleidoscope::Qukey> qukeys;
+#if QUKEYS_CHORDS_MAX
+  std::vector<kaleidoscope::Chord> chords;
+#endif
+  uint8_t hands[TOTAL_KEYS];
+  std::vector<std::string> prints;
+  uint32_t tail = 1000;
+  std::string trace_file;
+};
+
+class ScriptError {
+ public:
+  explicit ScriptError(const std::string &message) : message(message) {}
+  std::string message;
+};
+
+unsigned long number(std::istream &line, unsigned long max = 0xFFFF) {
+  std::string word;
+  char *end;
+  if (!(line >> word))
+    throw ScriptError("expected a number");
+  unsigned long value = strtoul(word.c_str(), &end, 0);
+  if (*end != '\0' || value > max)
+    throw ScriptError("bad number: " + word);
+  return value;
+}
+
+bool optionalNumber(std::istream &line, unsigned long &value, unsigned long max = 0xFFFF) {
+  line >> std::ws;
+  if (line.eof())
+    return false;
+  value = number(line, max);
+  return true;
+}
+
+Key keycode(std::istream &line) {
+  std::string word;
+  Key key;
+  if (!(line >> word))
+    throw ScriptError("expected a keycode");
+  if (!host::parseKey(word, key))
+    throw ScriptError("unknown keycode: " + word);
+  return key;
+}
+
+void keyAddr(std::istream &line, byte &row, byte &col) {
+  std::string word;
+  unsigned row_number, col_number;
+  char close;
+  if (!(line >> word) ||
+      sscanf(word.c_str(), "(%u,%u%c", &row_number, &col_number, &close) != 3 || close != ')')
+    throw ScriptError("expected a key as (row,col)");
+  if (row_number >= ROWS || col_number >= COLS)
+    throw ScriptError("no such key: " + word);
+  row = row_number;
+  col = col_number;
+}
+
+uint8_t layer(std::istream &line) {
+  return number(line, host::LAYERS - 1);
+}
+
+void expect(std::istream &line, const std::string &expected) {
+  std::string word;
+  if (!(line >> word) || word != expected)
+    throw ScriptError("expected '" + expected + "'");
+}
+
+void require(const std::string &feature) {
+  bool present;
+  if (feature == "chords")
+    present = QUKEYS_CHORDS_MAX;
+  else if (feature == "tap-dance")
+    present = QUKEYS_TAP_DANCE;
+  else if (feature == "adaptive")
+    present = QUKEYS_ADAPTIVE;
+  else if (feature == "streak-bypass")
+    present = QUKEYS_STREAK_BYPASS;
+  else if (feature == "quick-tap")
+    present = QUKEYS_QUICK_TAP;
+  else if (feature == "stats")
+    present = QUKEYS_STATS;
+  else if (feature == "report-latency")
+    present = QUKEYS_REPORT_LATENCY;
+  else if (feature == "trace")
+    present = QUKEYS_TRACE_SIZE;
+  else
+    throw ScriptError("unknown feature: " + feature);
+  if (!present) {
+    std::cerr << "skipped: needs " << feature << "\n";
+    exit(EXIT_SKIP);
+  }
+}
+
+void parseLine(Script &script, const std::string &text) {
+  std::istringstream line(text);
+  std::string command;
+  unsigned long value;
+  byte row, col;
+
+  if (!(line >> command) || command[0] == '#')
+    return;
+
+  if (command == "press" || command == "release") {
+    keyAddr(line, row, col);
+    expect(line, "at");
+    uint32_t time = number(line, 0xFFFFFFFF);
+    if (!script.events.empty() && time < script.events.back().time)
+      throw ScriptError("events must be in order of time");
+    script.events.push_back({time, row, col, command == "press"});
+  } else if (command == "print") {
+    // What to print after the reports
+    std::string what;
+    line >> what;
+    if (what == "stats")
+      require("stats");
+    else if (what == "latency")
+      require("report-latency");
+    else
+      throw ScriptError("print 'stats' or 'latency'");
+    script.prints.push_back(what);
+  } else if (command == "tail") {
+    // How long to keep scanning after the last event (1000ms by default)
+    script.tail = number(line, 0xFFFFFFFF);
+  } else if (!script.events.empty()) {
+    throw ScriptError("settings must come before the first event");
+  } else if (command == "require") {
+    std::string feature;
+    line >> feature;
+    require(feature);
+  } else if (command == "key") {
+    uint8_t key_layer = layer(line);
+    keyAddr(line, row, col);
+    host::setKey(key_layer, row, col, keycode(line));
+  } else if (command == "qukey") {
+    // qukey <layer|all> (row,col) <alternate> [time limit [release delay [double [triple]]]]
+    std::string layer_name;
+    int8_t qukey_layer;
+    line >> layer_name;
+    if (layer_name == "all") {
+      qukey_layer = QUKEY_ALL_LAYERS;
+    } else {
+      std::istringstream layer_line(layer_name);
+      qukey_layer = layer(layer_line);
+    }
+    keyAddr(line, row, col);
+    Key alt_keycode = keycode(line);
+    uint16_t time_limit = 0;
+    uint8_t release_delay = 0;
+    if (optionalNumber(line, value))
+      time_limit = value;
+    if (optionalNumber(line, value, 0xFF))
+      release_delay = value;
+    line >> std::ws;
+    if (!line.eof()) {
+#if QUKEYS_TAP_DANCE
+      Key double_tap_keycode = keycode(line);
+      Key triple_tap_keycode = Key_NoKey;
+      line >> std::ws;
+      if (!line.eof())
+        triple_tap_keycode = keycode(line);
+      if (double_tap_keycode.raw == Key_NoKey.raw &&
+          triple_tap_keycode.raw != Key_NoKey.raw)
+        throw ScriptError("a triple tap keycode needs a double tap keycode");
+      script.qukeys.push_back(kaleidoscope::Qukey(qukey_layer, row, col, alt_keycode,
+                              time_limit, release_delay,
+                              double_tap_keycode, triple_tap_keycode));
+      return;
+#else
+      throw ScriptError("tap-dance keycodes need QUKEYS_TAP_DANCE");
+#endif
+    }
+    script.qukeys.push_back(kaleidoscope::Qukey(qukey_layer, row, col, alt_keycode,
+                            time_limit, release_delay));
+  } else if (command == "chord") {
+    // chord <keycode> <time limit> (row,col) (row,col)...
+#if QUKEYS_CHORDS_MAX
+    Key chord_keycode = keycode(line);
+    uint8_t time_limit = number(line, 0xFF);
+    byte rows[4], cols[4];
+    uint8_t count = 0;
+    for (line >> std::ws; !line.eof() && count < 4; line >> std::ws, count++)
+      keyAddr(line, rows[count], cols[count]);
+    if (count == 2)
+      script.chords.push_back(kaleidoscope::Chord(chord_keycode, time_limit,
+                              rows[0], cols[0], rows[1], cols[1]));
+    else if (count == 3)
+      script.chords.push_back(kaleidoscope::Chord(chord_keycode, time_limit,
+                              rows[0], cols[0], rows[1], cols[1], rows[2], cols[2]));
+    else if (count == 4 && line.eof())
+      script.chords.push_back(kaleidoscope::Chord(chord_keycode, time_limit,
+                              rows[0], cols[0], rows[1], cols[1],
+                              rows[2], cols[2], rows[3], cols[3]));
+    else
+      throw ScriptError("a chord has two to four keys");
+    if (script.chords.size() > QUKEYS_CHORDS_MAX)
+      throw ScriptError("too many chords for QUKEYS_CHORDS_MAX");
+#else
+    throw ScriptError("chords need QUKEYS_CHORDS_MAX");
+#endif
+  } else if (command == "timeout") {
+    Qukeys.setTimeout(number(line));
+  } else if (command == "release-delay") {
+    Qukeys.setReleaseDelay(number(line, 0xFF));
+  } else if (command == "dual-use-timeouts") {
+    Qukeys.setDualUseModifierTimeout(number(line));
+    Qukeys.setDualUseLayerTimeout(number(line));
+  } else if (command == "adaptive-timeout") {
+    // adaptive-timeout <min> <max> [streak interval]
+#if QUKEYS_ADAPTIVE
+    unsigned long min = number(line);
+    unsigned long max = number(line);
+    if (optionalNumber(line, value))
+      Qukeys.setAdaptiveTimeout(min, max, value);
+    else
+      Qukeys.setAdaptiveTimeout(min, max);
+#else
+    throw ScriptError("adaptive time limits need QUKEYS_ADAPTIVE");
+#endif
+  } else if (command == "quick-tap-window") {
+#if QUKEYS_QUICK_TAP
+    Qukeys.setQuickTapWindow(number(line));
+#else
+    throw ScriptError("the quick-tap window needs QUKEYS_QUICK_TAP");
+#endif
+  } else if (command == "overflow-policy") {
+    std::string policy;
+    line >> policy;
+    if (policy == "alternate")
+      Qukeys.setOverflowPolicy(QUKEYS_OVERFLOW_ALTERNATE);
+    else if (policy == "primary")
+      Qukeys.setOverflowPolicy(QUKEYS_OVERFLOW_PRIMARY);
+    else
+      throw ScriptError("overflow-policy is 'alternate' or 'primary'");
+  } else if (command == "streak-bypass") {
+#if QUKEYS_STREAK_BYPASS
+    Qukeys.setStreakBypass(number(line));
+#else
+    throw ScriptError("the streak bypass needs QUKEYS_STREAK_BYPASS");
+#endif
+  } else if (command == "hands") {
+    // hands <col>: keys left of column <col> are on the left hand, and
+    // the others on the right
+    value = number(line, COLS);
+    for (uint8_t key_addr = 0; key_addr < TOTAL_KEYS; key_addr++)
+      script.hands[key_addr] = kaleidoscope::addr::col(key_addr) < value ?
+                               QUKEY_HAND_LEFT : QUKEY_HAND_RIGHT;
+    Qukeys.setHands(script.hands);
+  } else if (command == "same-hand-policy") {
+    std::string policy;
+    line >> policy;
+    if (policy == "wait")
+      Qukeys.setSameHandPolicy(QUKEYS_SAME_HAND_WAIT);
+    else if (policy == "primary")
+      Qukeys.setSameHandPolicy(QUKEYS_SAME_HAND_PRIMARY);
+    else
+      throw ScriptError("same-hand-policy is 'wait' or 'primary'");
+  } else if (command == "coalesce-reports") {
+    Qukeys.setReportCoalescing(true);
+  } else {
+    throw ScriptError("unknown command: " + command);
+  }
+
+  line >> std::ws;
+  if (!line.eof())
+    throw ScriptError("extra words at end of line");
+}
+
+void readScriptFile(Script &script, const std::string &file);
+
+void readScript(Script &script, std::istream &input, const std::string &name) {
+  std::string text;
+  for (unsigned line = 1; std::getline(input, text); line++) {
+    // include <file>: read another script (relative to this one) here
+    std::istringstream words(text);
+    std::string command, file;
+    if (words >> command && command == "include" && words >> file) {
+      size_t slash = name.rfind('/');
+      if (file[0] != '/' && slash != std::string::npos)
+        file = name.substr(0, slash + 1) + file;
+      readScriptFile(script, file);
+      continue;
+    }
+    try {
+      parseLine(script, text);
+    } catch (const ScriptError &e) {
+      std::cerr << name << ":" << line << ": " << e.message << "\n";
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void readScriptFile(Script &script, const std::string &file) {
+  std::ifstream input(file);
+  if (!input) {
+    perror(file.c_str());
+    exit(EXIT_FAILURE);
+  }
+  readScript(script, input, file);
+}
+
+void run(const Script &script) {
+  Qukeys.qukeys = const_cast<kaleidoscope::Qukey *>(script.qukeys.data());
+  Qukeys.qukeys_count = script.qukeys.size();
+#if QUKEYS_CHORDS_MAX
+  Qukeys.setChords(script.chords.data(), script.chords.size());
+#endif
+  Kaleidoscope.setup();
+
+  uint32_t end = script.events.empty() ? 0 : script.events.back().time;
+  end += script.tail;
+  size_t next = 0;
+  for (uint32_t time = 0; time <= end; time++) {
+    host::setTime(time);
+    for (; next < script.events.size() && script.events[next].time == time; next++) {
+      const Event &event = script.events[next];
+      host::setKeyswitch(event.row, event.col, event.press);
+    }
+    Kaleidoscope.loop();
+  }
+
+  for (const auto &report : host::reports)
+    std::cout << "report at " << report.time << ": " << host::reportKeys(report.data) << "\n";
+}
+
+void printStats() {
+#if QUKEYS_STATS
+  const kaleidoscope::QukeysStats &stats = Qukeys.stats();
+  std::cout << "timeouts " << stats.timeouts << "\n"
+            << "later_releases " << stats.later_releases << "\n"
+            << "taps " << stats.taps << "\n"
+            << "release_delays " << stats.release_delays << "\n"
+            << "overflows " << stats.overflows << "\n"
+            << "opposite_hand " << stats.opposite_hand << "\n"
+            << "same_hand " << stats.same_hand << "\n"
+            << "quick_taps " << stats.quick_taps << "\n"
+            << "streak_bypassed " << stats.streak_bypassed << "\n"
+            << "streak_queued " << stats.streak_queued << "\n"
+            << "reports_saved " << stats.reports_saved << "\n"
+            << "queue_depth";
+  for (uint8_t i = 0; i < QUKEYS_QUEUE_MAX; i++)
+    std::cout << " " << stats.queue_depth[i];
+  std::cout << "\n"
+            << "flushed " << stats.flushed << "\n"
+            << "latency_min " << stats.latency_min << "\n"
+            << "latency_max " << stats.latency_max << "\n"
+            << "latency_average " << stats.latencyAverage() << "\n"
+            << "latency";
+  for (uint8_t i = 0; i < QUKEYS_LATENCY_BUCKETS; i++)
+    std::cout << " " << stats.latency[i];
+  std::cout << "\n";
+#endif
+}
+
+void print(const Script &script) {
+  for (const auto &what : script.prints) {
+    std::cout.flush();
+    if (what == "stats") {
+      printStats();
+    } else if (what == "latency") {
+#if QUKEYS_REPORT_LATENCY
+      Qukeys.printReportLatency();
+      fflush(stdout);
+#endif
+    }
+  }
+
+#if QUKEYS_TRACE_SIZE
+  if (!script.trace_file.empty()) {
+    FILE *trace = fopen(script.trace_file.c_str(), "wb");
+    if (trace == nullptr) {
+      perror(script.trace_file.c_str());
+      exit(EXIT_FAILURE);
+    }
+    host::setSerialOutput(trace);
+    Qukeys.dumpTrace();
+    host::setSerialOutput(stdout);
+    fclose(trace);
+  }
+#endif
+}
+
+void usage() {
+  std::cerr << "usage: qukeys-sim [--trace FILE] [SCRIPT...]\n";
+  exit(EXIT_FAILURE);
+}
+
+} // namespace {
+
+int main(int argc, char **argv) {
+  Script script;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--trace" && i + 1 < argc) {
+#if QUKEYS_TRACE_SIZE
+      script.trace_file = argv[++i];
+#else
+      std::cerr << "qukeys-sim: built without QUKEYS_TRACE_SIZE\n";
+      return EXIT_SKIP;
+#endif
+    } else if (arg.size() > 1 && arg[0] == '-') {
+      usage();
+    } else {
+      files.push_back(arg);
+    }
+  }
+
+  host::reset();
+  if (files.empty()) {
+    readScript(script, std::cin, "<stdin>");
+  } else {
+    for (const auto &file : files)
+      readScriptFile(script, file);
+  }
+
+  run(script);
+  print(script);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/* -*- mode: c++ -*-
+ * Kaleidoscope-Qukeys -- Assign two keycodes to a single key
+ * Copyright (C) 2017  Michael Richters
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the QUKEYS_STATS counters over more keys than a 16-bit counter
+// can hold. Scripts are far too short for that, so this one is in code.
+
+#include <Kaleidoscope.h>
+#include <Kaleidoscope-Qukeys.h>
+
+#include <iostream>
+
+#include "host.h"
+
+static_assert(QUKEYS_STATS, "build this with -DQUKEYS_STATS=1");
+
+namespace {
+
+int checks = 0;
+int failures = 0;
+
+void check(const char *name, unsigned long value, unsigned long expected) {
+  checks++;
+  if (value != expected) {
+    std::cout << "FAIL: " << name << ": " << value << ", expected " << expected << "\n";
+    failures++;
+  }
+}
+
+void checkRange(const char *name, unsigned long value, unsigned long min, unsigned long max) {
+  checks++;
+  if (value < min || value > max) {
+    std::cout << "FAIL: " << name << ": " << value << ", expected " << min << " to " << max << "\n";
+    failures++;
+  }
+}
+
+uint32_t current_time = 0;
+
+void scanAt(uint32_t time) {
+  current_time = time;
+  host::setTime(time);
+  Kaleidoscope.loop();
+}
+
+// Tap the qukey, holding it for `hold_time` ms
+void tap(uint16_t hold_time) {
+  host::setKeyswitch(2, 1, true);
+  scanAt(current_time + 1);
+  host::setKeyswitch(2, 1, false);
+  scanAt(current_time + hold_time);
+  scanAt(current_time + 1);
+}
+
+} // namespace {
+
+int main() {
+  host::reset();
+  Kaleidoscope.setup();
+  QUKEYS(kaleidoscope::Qukey(0, 2, 1, Key_LeftGui))
+  Qukeys.resetStats();
+
+  for (uint32_t i = 0; i < 70000; i++)
+    tap(40);
+  const kaleidoscope::QukeysStats &stats = Qukeys.stats();
+  check("taps saturate", stats.taps, 0xFFFF);
+  check("average after 70000 taps", stats.latencyAverage(), 40);
+
+  // Later keys still move the average once the count has been halved,
+  // with older ones weighing less (but not nothing)
+  for (uint32_t i = 0; i < 70000; i++)
+    tap(100);
+  checkRange("average after 70000 longer taps", stats.latencyAverage(), 70, 99);
+  check("latency max", stats.latency_max, 100);
+
+  std::cout << "stats: " << checks - failures << " passed, " << failures << " failed\n";
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}